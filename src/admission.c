@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "admission.h"
+
+// What the server remembers about a client address
+typedef struct
+{
+    in_addr_t address;
+    int used;
+    int connections;     // Queued, in handshake or admitted
+    time_t last_session; // When a session from this address was last admitted or ended, 0 if never
+} tracked_ip;
+
+int admission_per_ip = ADMISSION_PER_IP;
+int admission_queue_limit = ADMISSION_QUEUE;
+pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t admission_ready; // Signalled when a connection is queued or a session ends
+
+static tracked_ip tracked_ips[ADMISSION_TRACKED_IPS];
+static int tracked_count = 0;
+
+// Waiting connections, returning addresses first; each list is FIFO
+static pending_connection *queue_heads[2];
+static pending_connection *queue_tails[2];
+static int queued[2];
+static int handshaking = 0;
+
+static unsigned long accepted = 0;
+static unsigned long admitted = 0;
+static unsigned long releases = 0;
+static unsigned long shed_per_ip = 0;
+static unsigned long shed_queue_full = 0;
+static unsigned long shed_timed_out = 0;
+static unsigned long shed_no_descriptors = 0;
+static unsigned long abandoned = 0;
+
+static pthread_once_t cond_once = PTHREAD_ONCE_INIT;
+
+// Handshake threads wait with a timeout, so the condition runs on the monotonic clock
+static void init_cond()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&admission_ready, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static time_t now_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+// Wait on admission_ready for up to a second; called with admission_mutex held
+static void wait_ready()
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&admission_ready, &admission_mutex, &deadline);
+}
+
+// Find the entry for an address, or claim one for it. Returns NULL if every probed entry has live connections.
+static tracked_ip *find_ip(in_addr_t address, time_t now)
+{
+    // Mix the high bits in too: neighbouring addresses differ only in the last octet
+    unsigned int hash = ntohl(address) * 2654435761u;
+    unsigned int start = (hash ^ (hash >> 16)) & (ADMISSION_TRACKED_IPS - 1);
+    tracked_ip *reusable = NULL;
+    tracked_ip *oldest_idle = NULL;
+    for (int i = 0; i < ADMISSION_PROBES; i++)
+    {
+        tracked_ip *ip = &tracked_ips[(start + i) & (ADMISSION_TRACKED_IPS - 1)];
+        if (!ip->used)
+        {
+            // Addresses are never removed, only replaced, so an unused entry ends the search
+            if (reusable == NULL)
+            {
+                reusable = ip;
+                tracked_count++;
+            }
+            break;
+        }
+        if (ip->address == address)
+        {
+            return ip;
+        }
+        if (ip->connections == 0)
+        {
+            if (reusable == NULL && now - ip->last_session >= ADMISSION_RETURNING_WINDOW)
+            {
+                reusable = ip;
+            }
+            if (oldest_idle == NULL || ip->last_session < oldest_idle->last_session)
+            {
+                oldest_idle = ip;
+            }
+        }
+    }
+
+    // Under pressure, forget the idle address seen longest ago
+    if (reusable == NULL)
+    {
+        reusable = oldest_idle;
+    }
+    if (reusable != NULL)
+    {
+        *reusable = (tracked_ip){.address = address, .used = 1};
+    }
+    return reusable;
+}
+
+// Tell a connection the server cannot take it and close it
+static void turn_away(int socket)
+{
+    const char *busy = "[SERVER]: The server is busy, please try again later.";
+    send(socket, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(socket);
+}
+
+// Drop a waiting connection's claim on its address; called with admission_mutex held
+static void forget_pending(pending_connection *connection, time_t now)
+{
+    // Addresses with connections are never replaced, so the entry is still there
+    tracked_ip *ip = find_ip(connection->address, now);
+    if (ip != NULL && ip->connections > 0)
+    {
+        ip->connections--;
+    }
+}
+
+static pending_connection *pop_queue(int returning)
+{
+    pending_connection *connection = queue_heads[returning];
+    if (connection != NULL)
+    {
+        queue_heads[returning] = connection->next;
+        if (queue_heads[returning] == NULL)
+        {
+            queue_tails[returning] = NULL;
+        }
+        queued[returning]--;
+    }
+    return connection;
+}
+
+// Take the connections that have waited longer than ADMISSION_TIMEOUT; called with admission_mutex held
+static pending_connection *take_stale()
+{
+    pending_connection *expired = NULL;
+    time_t now = now_seconds();
+    for (int returning = 1; returning >= 0; returning--)
+    {
+        while (queue_heads[returning] != NULL && now - queue_heads[returning]->queued_at >= ADMISSION_TIMEOUT)
+        {
+            pending_connection *stale = pop_queue(returning);
+            forget_pending(stale, now);
+            shed_timed_out++;
+            stale->next = expired;
+            expired = stale;
+        }
+    }
+    return expired;
+}
+
+static void turn_away_all(pending_connection *connections)
+{
+    while (connections != NULL)
+    {
+        pending_connection *next = connections->next;
+        turn_away(connections->socket);
+        free(connections);
+        connections = next;
+    }
+}
+
+// Queue a freshly accepted connection, or turn it away. Called by the accepting thread only.
+void admission_offer(int socket, in_addr_t address)
+{
+    pthread_once(&cond_once, init_cond);
+    time_t now = now_seconds();
+    pending_connection *connection = malloc(sizeof(pending_connection));
+    pending_connection *evicted = NULL;
+    if (connection == NULL)
+    {
+        perror("Malloc failed");
+        turn_away(socket);
+        return;
+    }
+
+    pthread_mutex_lock(&admission_mutex);
+    accepted++;
+    tracked_ip *ip = find_ip(address, now);
+    if (ip == NULL || ip->connections >= admission_per_ip)
+    {
+        shed_per_ip++;
+        pthread_mutex_unlock(&admission_mutex);
+        free(connection);
+        turn_away(socket);
+        return;
+    }
+
+    int returning = ip->last_session != 0 && now - ip->last_session < ADMISSION_RETURNING_WINDOW;
+    if (queued[0] + queued[1] >= admission_queue_limit)
+    {
+        // A full queue makes room for a returning address by dropping the oldest new one
+        if (!returning || (evicted = pop_queue(0)) == NULL)
+        {
+            shed_queue_full++;
+            pthread_mutex_unlock(&admission_mutex);
+            free(connection);
+            turn_away(socket);
+            return;
+        }
+        shed_queue_full++;
+        forget_pending(evicted, now);
+    }
+
+    ip->connections++;
+    *connection = (pending_connection){socket, address, now, returning, NULL};
+    if (queue_tails[returning] != NULL)
+    {
+        queue_tails[returning]->next = connection;
+    }
+    else
+    {
+        queue_heads[returning] = connection;
+    }
+    queue_tails[returning] = connection;
+    queued[returning]++;
+    pthread_cond_signal(&admission_ready);
+    pthread_mutex_unlock(&admission_mutex);
+
+    if (evicted != NULL)
+    {
+        turn_away(evicted->socket);
+        free(evicted);
+    }
+}
+
+// Count a connection that could not even be accepted for lack of file descriptors
+void admission_overflow()
+{
+    pthread_mutex_lock(&admission_mutex);
+    shed_no_descriptors++;
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+// Wait up to a second for the next connection to hand to the engine, returning addresses first.
+// Connections that have waited longer than ADMISSION_TIMEOUT are turned away on the way.
+pending_connection *admission_next()
+{
+    pthread_once(&cond_once, init_cond);
+    pending_connection *connection = NULL;
+
+    pthread_mutex_lock(&admission_mutex);
+    if (queued[0] + queued[1] == 0)
+    {
+        wait_ready();
+    }
+    pending_connection *expired = take_stale();
+    if ((connection = pop_queue(1)) != NULL || (connection = pop_queue(0)) != NULL)
+    {
+        handshaking++;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+
+    turn_away_all(expired);
+    return connection;
+}
+
+// The engine had no room after all; put the connection back at the front of its queue
+void admission_retry(pending_connection *connection)
+{
+    pthread_mutex_lock(&admission_mutex);
+    handshaking--;
+    connection->next = queue_heads[connection->returning];
+    queue_heads[connection->returning] = connection;
+    if (queue_tails[connection->returning] == NULL)
+    {
+        queue_tails[connection->returning] = connection;
+    }
+    queued[connection->returning]++;
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+// The client hung up while it waited; drop the connection without bothering the engine
+void admission_abandon(pending_connection *connection)
+{
+    pthread_mutex_lock(&admission_mutex);
+    handshaking--;
+    abandoned++;
+    forget_pending(connection, now_seconds());
+    pthread_mutex_unlock(&admission_mutex);
+    close(connection->socket);
+    free(connection);
+}
+
+// The engine took the connection; its address now counts as returning. Frees the queue entry.
+void admission_admitted(pending_connection *connection)
+{
+    time_t now = now_seconds();
+    pthread_mutex_lock(&admission_mutex);
+    handshaking--;
+    admitted++;
+    tracked_ip *ip = find_ip(connection->address, now);
+    if (ip != NULL)
+    {
+        ip->last_session = now;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+    free(connection);
+}
+
+// An admitted connection has ended, so its slot may go to a waiting one
+void admission_release(in_addr_t address)
+{
+    pthread_once(&cond_once, init_cond);
+    time_t now = now_seconds();
+    pthread_mutex_lock(&admission_mutex);
+    tracked_ip *ip = find_ip(address, now);
+    if (ip != NULL && ip->connections > 0)
+    {
+        ip->connections--;
+        ip->last_session = now;
+    }
+    releases++;
+    pthread_cond_broadcast(&admission_ready);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+// Sessions ended so far; pass it to admission_wait_release() to sleep until the next one
+unsigned long admission_release_count()
+{
+    pthread_mutex_lock(&admission_mutex);
+    unsigned long count = releases;
+    pthread_mutex_unlock(&admission_mutex);
+    return count;
+}
+
+// Wait up to a second for a session to end after the count was read. Connections stop
+// waiting for a slot after ADMISSION_TIMEOUT even while no session ends.
+void admission_wait_release(unsigned long seen)
+{
+    pthread_once(&cond_once, init_cond);
+    pthread_mutex_lock(&admission_mutex);
+    if (releases == seen)
+    {
+        wait_ready();
+    }
+    pending_connection *expired = take_stale();
+    pthread_mutex_unlock(&admission_mutex);
+
+    turn_away_all(expired);
+}
+
+// Format admission statistics into out
+void format_admission_stats(char *out, size_t size)
+{
+    pthread_mutex_lock(&admission_mutex);
+    snprintf(out, size, "Admission: %d queued (%d returning), %d in handshake, %d address(es) tracked\n"
+                        "Accepted: %lu, admitted: %lu, turned away: %lu over the per-IP cap, %lu queue full, %lu timed out, %lu out of descriptors, %lu abandoned",
+             queued[0] + queued[1], queued[1], handshaking, tracked_count,
+             accepted, admitted, shed_per_ip, shed_queue_full, shed_timed_out, shed_no_descriptors, abandoned);
+    pthread_mutex_unlock(&admission_mutex);
+}
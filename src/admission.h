@@ -0,0 +1,45 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define ADMISSION_BACKLOG 1024         // Default listen() backlog
+#define ADMISSION_ACCEPT_BATCH 64      // Connections accepted per wakeup of the main loop
+#define ADMISSION_PER_IP 8             // Default cap on connections from one address
+#define ADMISSION_QUEUE 512            // Default cap on connections waiting for a client slot
+#define ADMISSION_QUEUE_MAX 16384      // Largest queue /limit accepts
+#define ADMISSION_HANDSHAKES 4         // Default number of handshake threads
+#define ADMISSION_TIMEOUT 10           // Seconds a connection may wait for a slot
+#define ADMISSION_RETURNING_WINDOW 600 // Seconds an address counts as returning after its last session
+#define ADMISSION_TRACKED_IPS 4096     // Addresses remembered (must be a power of two)
+#define ADMISSION_PROBES 32            // Table slots searched per address
+
+// An accepted connection waiting for a handshake thread
+typedef struct pending_connection
+{
+    int socket;
+    in_addr_t address;
+    time_t queued_at;
+    int returning; // Its address had a session recently, so it goes ahead of new ones
+    struct pending_connection *next;
+} pending_connection;
+
+extern int admission_per_ip;      // Guarded by admission_mutex
+extern int admission_queue_limit; // Guarded by admission_mutex
+extern pthread_mutex_t admission_mutex;
+
+void admission_offer(int socket, in_addr_t address);
+void admission_overflow();
+pending_connection *admission_next();
+void admission_retry(pending_connection *connection);
+void admission_abandon(pending_connection *connection);
+void admission_admitted(pending_connection *connection);
+void admission_release(in_addr_t address);
+unsigned long admission_release_count();
+void admission_wait_release(unsigned long seen);
+void format_admission_stats(char *out, size_t size);
+
+#endif
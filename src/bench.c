@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+#define BUFFER_SIZE 1024
+
+// Latency benchmark: one connection sends private messages to another, one at a time,
+// and the round trip through the server is timed. Run it against a server started with
+// and without -l/-b/-c to compare the modes.
+
+long now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Connect and claim a username; the server's replies are read and discarded
+int join(const char *ip, int port, const char *username)
+{
+    struct sockaddr_in server_addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0)
+    {
+        fprintf(stderr, "Invalid address: %s\n", ip);
+        exit(EXIT_FAILURE);
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Connection failed");
+        exit(EXIT_FAILURE);
+    }
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    char buffer[BUFFER_SIZE];
+    // Wait for the prompt, then for the confirmation, so they are not mistaken for results
+    if (recv(sock, buffer, sizeof(buffer), 0) <= 0)
+    {
+        fprintf(stderr, "The server closed the connection (is it full?)\n");
+        exit(EXIT_FAILURE);
+    }
+    int length = snprintf(buffer, sizeof(buffer), "/username %s\n", username);
+    send(sock, buffer, length, 0);
+    if (recv(sock, buffer, sizeof(buffer), 0) <= 0)
+    {
+        fprintf(stderr, "The server closed the connection.\n");
+        exit(EXIT_FAILURE);
+    }
+    return sock;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 10000;
+    int interval_us = 0;
+
+    // Parse command-line options
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = atoi(optarg); // Messages to time
+            break;
+        case 'i':
+            interval_us = atoi(optarg); // Idle time between messages, so server threads go back to sleep
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n messages] [-i interval_us] <ip_address> <port>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2 || count < 1)
+    {
+        fprintf(stderr, "Usage: %s [-n messages] [-i interval_us] <ip_address> <port>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const char *ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+
+    char sender_name[64], receiver_name[64];
+    snprintf(sender_name, sizeof(sender_name), "bench_tx_%d", getpid());
+    snprintf(receiver_name, sizeof(receiver_name), "bench_rx_%d", getpid());
+    int sender = join(ip, port, sender_name);
+    int receiver = join(ip, port, receiver_name);
+
+    long *samples = malloc(count * sizeof(long));
+    if (samples == NULL)
+    {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+
+    char message[BUFFER_SIZE];
+    char buffer[BUFFER_SIZE];
+    for (int i = 0; i < count; i++)
+    {
+        int length = snprintf(message, sizeof(message), "/private %s %d\n", receiver_name, i);
+        long start = now_ns();
+        if (send(sender, message, length, 0) != length)
+        {
+            perror("Send failed");
+            exit(EXIT_FAILURE);
+        }
+        // Only one message is in flight, so one read returns exactly one delivery
+        if (recv(receiver, buffer, sizeof(buffer), 0) <= 0)
+        {
+            fprintf(stderr, "The server closed the connection.\n");
+            exit(EXIT_FAILURE);
+        }
+        samples[i] = now_ns() - start;
+        if (interval_us > 0)
+        {
+            usleep(interval_us);
+        }
+    }
+
+    qsort(samples, count, sizeof(long), compare_long);
+    double total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        total += samples[i];
+    }
+    printf("%d round trips, interval %d us\n", count, interval_us);
+    printf("min %.1f us, mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+           samples[0] / 1000.0, total / count / 1000.0, samples[count / 2] / 1000.0,
+           samples[(int)(count * 0.99)] / 1000.0, samples[(int)(count * 0.999)] / 1000.0, samples[count - 1] / 1000.0);
+
+    close(sender);
+    close(receiver);
+    free(samples);
+    return 0;
+}
@@ -84,10 +84,12 @@ int main(int argc, char *argv[])
 
     // Main input loop
     char buffer[BUFFER_SIZE];
+    char frame[BUFFER_SIZE + 1];
     while (running)
     {
         fgets(buffer, BUFFER_SIZE, stdin);
         buffer[strcspn(buffer, "\n")] = '\0'; // Remove newline
+        snprintf(frame, sizeof(frame), "%s\n", buffer); // The server reads one command per line
 
         if (strcmp(buffer, "/help") == 0)
         {
@@ -100,7 +102,7 @@ int main(int argc, char *argv[])
             intentional_disconnect = 1; // Mark the disconnect as intentional
 
             // Send the quit command to the server
-            if (send(client_socket, buffer, strlen(buffer), 0) < 0)
+            if (send(client_socket, frame, strlen(frame), 0) < 0)
             {
                 perror("Send failed");
             }
@@ -121,7 +123,7 @@ int main(int argc, char *argv[])
             }
             break;
         }
-        else if (send(client_socket, buffer, strlen(buffer), 0) < 0)
+        else if (send(client_socket, frame, strlen(frame), 0) < 0)
         {
             perror("Send failed");
             break;
@@ -187,5 +189,6 @@ void print_help()
            "/help - Show this help message\n"
            "/list - List all connected clients\n"
            "/private <username> <message> - Send a private message to a user\n"
+           "/search [-p page] <terms> - Search chat history (use from:<username> to filter by author)\n"
            "/quit - Disconnect from the server\n\n");
 }
\ No newline at end of file
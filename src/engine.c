@@ -0,0 +1,732 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "engine.h"
+
+// A connected client. I/O threads refer to it only by id, so it can be freed as soon as it leaves.
+typedef struct
+{
+    unsigned long id;
+    int handle;
+    char username[ENGINE_NAME_SIZE];
+    int username_set; // Flag to check if username is set
+} engine_conn;
+
+// A runtime-adjustable limit, changed with the admin /limit command
+typedef struct
+{
+    const char *name;
+    int *value;
+    int min;
+    int max;
+    pthread_mutex_t *mutex; // Lock that guards readers of the value, NULL for the engine lock
+} runtime_limit;
+
+// What admin /list and /stats report, copied out of the engine as it changes
+typedef struct
+{
+    int conn_count;
+    int client_limit;
+    unsigned long frames;
+    unsigned long messages;
+    char list[ENGINE_REPLY_SIZE];
+} engine_snapshot;
+
+struct engine
+{
+    const engine_ops *ops;
+    void *io;
+    engine_conn *conns[ENGINE_MAX_CLIENTS];
+    int conn_count;
+    unsigned long next_id;
+    int client_limit;
+    int stopped; // Set once the admin has shut the server down
+    runtime_limit limits[ENGINE_MAX_LIMITS];
+    int limit_count;
+    unsigned long frames;   // Client frames processed
+    unsigned long messages; // Chat messages broadcast
+    int roster_changed;     // A client joined, left or renamed since the last snapshot
+    pthread_mutex_t lock;   // Held by every entry point, so handlers run one at a time
+    engine_snapshot snapshot;
+    pthread_mutex_t snapshot_lock; // Taken inside lock, never held across a callback
+};
+
+// State shared by the client and admin command paths
+struct command_context
+{
+    engine *chat;
+    engine_conn *conn;      // Set for commands from a client
+    const reply_sink *sink; // Set for commands from the admin
+    int origin;             // COMMAND_CLIENT or COMMAND_ADMIN
+    int quit;               // Set once the client has asked to leave
+    int shutdown;           // Set once the admin has asked to shut down
+};
+
+static pthread_once_t commands_once = PTHREAD_ONCE_INIT;
+
+static void log_line(engine *chat, const char *format, ...)
+{
+    char line[ENGINE_NAME_SIZE * 2 + 100];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    chat->ops->log(chat->io, line);
+}
+
+static void send_text(engine *chat, int handle, const char *text)
+{
+    chat->ops->send(chat->io, handle, text, strlen(text));
+}
+
+static void vreply(command_context *ctx, int error, const char *format, va_list args)
+{
+    char message[ENGINE_REPLY_SIZE];
+    vsnprintf(message, sizeof(message), format, args);
+    if (ctx->conn != NULL)
+    {
+        send_text(ctx->chat, ctx->conn->handle, message);
+    }
+    else
+    {
+        ctx->sink->reply(ctx->sink->arg, error, message);
+    }
+}
+
+// Send a reply to whoever issued the command
+static void reply(command_context *ctx, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vreply(ctx, 0, format, args);
+    va_end(args);
+}
+
+// Report a failed command; admin socket sessions get it on the status line
+static void reply_error(command_context *ctx, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vreply(ctx, 1, format, args);
+    va_end(args);
+}
+
+static engine_conn *find_by_id(engine *chat, unsigned long id)
+{
+    for (int i = 0; i < chat->conn_count; i++)
+    {
+        if (chat->conns[i]->id == id)
+        {
+            return chat->conns[i];
+        }
+    }
+    return NULL;
+}
+
+static engine_conn *find_by_name(engine *chat, const char *username)
+{
+    for (int i = 0; i < chat->conn_count; i++)
+    {
+        if (strcmp(chat->conns[i]->username, username) == 0)
+        {
+            return chat->conns[i];
+        }
+    }
+    return NULL;
+}
+
+// Remove a client from the table and free it
+static void remove_conn(engine *chat, engine_conn *conn)
+{
+    for (int i = 0; i < chat->conn_count; i++)
+    {
+        if (chat->conns[i] == conn)
+        {
+            chat->conns[i] = chat->conns[--chat->conn_count]; // Replace with the last client
+            chat->conns[chat->conn_count] = NULL;              // Clear the last entry
+            break;
+        }
+    }
+    chat->roster_changed = 1;
+    free(conn);
+}
+
+// Broadcast a message to all clients except the sender (0 sends to everyone)
+static void broadcast_message(engine *chat, const char *message, unsigned long sender_id)
+{
+    for (int i = 0; i < chat->conn_count; i++)
+    {
+        if (chat->conns[i]->id != sender_id)
+        {
+            send_text(chat, chat->conns[i]->handle, message);
+        }
+    }
+}
+
+// Send a private message to a client, or queue it if they are offline
+static void send_private_message(command_context *ctx, const char *recipient, const char *message)
+{
+    engine *chat = ctx->chat;
+    char formatted_message[ENGINE_MESSAGE_SIZE];
+    snprintf(formatted_message, sizeof(formatted_message), "[Private from %s]: %s", ctx->conn->username, message);
+
+    engine_conn *target = find_by_name(chat, recipient);
+    if (target != NULL)
+    {
+        send_text(chat, target->handle, formatted_message);
+    }
+    else if (chat->ops->store_offline(chat->io, recipient, formatted_message) == 0)
+    {
+        // Store the message until the recipient claims the name again
+        reply(ctx, "[SERVER]: '%s' is offline. The message will be delivered when they reconnect.", recipient);
+    }
+    else
+    {
+        reply(ctx, "[SERVER]: '%s' is offline and the message could not be queued.", recipient);
+    }
+}
+
+static void cmd_username(command_context *ctx, str_view args)
+{
+    engine *chat = ctx->chat;
+    engine_conn *conn = ctx->conn;
+
+    // Remove trailing spaces from the requested username
+    while (args.length > 0 && (args.data[args.length - 1] == ' ' || args.data[args.length - 1] == '\t'))
+    {
+        args.length--;
+    }
+    char requested_username[ENGINE_NAME_SIZE];
+    snprintf(requested_username, sizeof(requested_username), "%.*s", (int)args.length, args.data);
+
+    if (find_by_name(chat, requested_username) != NULL)
+    {
+        reply(ctx, "[SERVER]: The username is already taken.");
+        return;
+    }
+    if (strlen(requested_username) == 0)
+    {
+        reply(ctx, "[SERVER]: Invalid username. Please provide a non-empty username.");
+        return;
+    }
+
+    memcpy(conn->username, requested_username, sizeof(conn->username));
+    conn->username_set = 1;
+    chat->roster_changed = 1;
+    reply(ctx, "[SERVER]: Username set to %s", conn->username);
+
+    // Flush anything that was sent to this name while it was offline; messages read back
+    // from disk arrive later through engine_deliver()
+    size_t length;
+    char *batch = chat->ops->take_offline(chat->io, conn->username, conn->id, &length);
+    if (batch != NULL)
+    {
+        chat->ops->send(chat->io, conn->handle, batch, length);
+        free(batch);
+    }
+
+    // Broadcast to all clients except the new client
+    char notification_message[ENGINE_NAME_SIZE + 50];
+    snprintf(notification_message, sizeof(notification_message), "[SERVER]: '%s' has joined the chat room.", conn->username);
+    broadcast_message(chat, notification_message, conn->id);
+}
+
+static void cmd_help(command_context *ctx, str_view args)
+{
+    if (ctx->origin == COMMAND_ADMIN)
+    {
+        reply(ctx, ENGINE_HELP);
+    }
+    else
+    {
+        reply(ctx, "[SERVER]: You do not have permission to see the server help.");
+    }
+}
+
+static void format_list(engine *chat, char *list, size_t size)
+{
+    size_t length = snprintf(list, size, "Connected clients:");
+    for (int i = 0; i < chat->conn_count && length < size; i++)
+    {
+        length += snprintf(list + length, size - length, "\n%s", chat->conns[i]->username);
+    }
+}
+
+// Clients see the live table; the admin sees the last published snapshot
+static void cmd_list(command_context *ctx, str_view args)
+{
+    engine *chat = ctx->chat;
+    char list[ENGINE_REPLY_SIZE];
+    if (ctx->origin == COMMAND_ADMIN)
+    {
+        pthread_mutex_lock(&chat->snapshot_lock);
+        memcpy(list, chat->snapshot.list, sizeof(list));
+        pthread_mutex_unlock(&chat->snapshot_lock);
+    }
+    else
+    {
+        format_list(chat, list, sizeof(list));
+    }
+    reply(ctx, "%s", list);
+}
+
+// "/private <username> <message>"; the message runs to the end of the frame, so it is NUL-terminated
+static void cmd_private(command_context *ctx, str_view args)
+{
+    str_view recipient_view = next_token(&args);
+    str_view message = skip_spaces(args);
+    if (recipient_view.length == 0 || message.length == 0)
+    {
+        reply_error(ctx, "%sUsage: /private <username> <message>", ctx->conn ? "[SERVER]: " : "");
+        return;
+    }
+
+    char recipient[ENGINE_NAME_SIZE];
+    snprintf(recipient, sizeof(recipient), "%.*s", (int)recipient_view.length, recipient_view.data);
+    if (ctx->origin == COMMAND_ADMIN)
+    {
+        engine_conn *target = find_by_name(ctx->chat, recipient);
+        if (target == NULL)
+        {
+            reply_error(ctx, "Recipient '%s' not found.", recipient);
+            return;
+        }
+        char formatted_message[ENGINE_NAME_SIZE + 50];
+        snprintf(formatted_message, sizeof(formatted_message), "[Private from SERVER]: %s", message.data);
+        send_text(ctx->chat, target->handle, formatted_message);
+    }
+    else if (ctx->conn->username_set)
+    {
+        send_private_message(ctx, recipient, message.data);
+    }
+    else
+    {
+        reply(ctx, "[SERVER]: You must set a username before sending messages.");
+    }
+}
+
+// "/search [-p page] <terms>"; results are delivered later through engine_deliver()
+static void cmd_search(command_context *ctx, str_view args)
+{
+    engine *chat = ctx->chat;
+    int page = 1;
+    str_view cursor = args;
+    if (view_equals(next_token(&cursor), "-p"))
+    {
+        page = atoi(skip_spaces(cursor).data);
+        next_token(&cursor);
+        args = skip_spaces(cursor);
+    }
+    if (chat->ops->submit_search(chat->io, ctx->conn->id, args.data, page) != 0)
+    {
+        reply(ctx, "[SERVER]: Search is busy, please try again later.");
+    }
+}
+
+static void cmd_quit(command_context *ctx, str_view args)
+{
+    engine_conn *conn = ctx->conn;
+    reply(ctx, "[SERVER]: Goodbye, %s!", conn->username);
+
+    // Notify others about this client quitting
+    char quit_message[ENGINE_NAME_SIZE + 50];
+    snprintf(quit_message, sizeof(quit_message), "[SERVER]: %s has left the chat.", conn->username);
+    broadcast_message(ctx->chat, quit_message, conn->id);
+
+    ctx->quit = 1;
+}
+
+static void cmd_shutdown(command_context *ctx, str_view args)
+{
+    if (ctx->origin == COMMAND_CLIENT)
+    {
+        // Only the server can shut itself down
+        reply(ctx, "[SERVER]: You do not have permission to shut down the server.");
+        return;
+    }
+
+    // Notify all clients that the server is shutting down
+    broadcast_message(ctx->chat, "[SERVER]: The server is shutting down. You will be disconnected.", 0);
+    reply(ctx, "Server is shutting down.");
+    ctx->chat->stopped = 1;
+    ctx->shutdown = 1;
+}
+
+static void cmd_remove(command_context *ctx, str_view args)
+{
+    engine *chat = ctx->chat;
+    str_view username_view = next_token(&args);
+    if (username_view.length == 0)
+    {
+        reply_error(ctx, "Usage: /remove <username>");
+        return;
+    }
+    char username[ENGINE_NAME_SIZE];
+    snprintf(username, sizeof(username), "%.*s", (int)username_view.length, username_view.data);
+
+    engine_conn *target = find_by_name(chat, username);
+    if (target == NULL)
+    {
+        reply_error(ctx, "No client named '%s'.", username);
+        return;
+    }
+
+    // The client's I/O thread only holds its id, so the entry can go right away;
+    // it finds the id gone when its connection drops and skips the disconnect notice
+    send_text(chat, target->handle, "[SERVER]: You are kicked out by the admin!");
+    chat->ops->disconnect(chat->io, target->handle);
+    remove_conn(chat, target);
+    reply(ctx, "%s Removed!", username);
+}
+
+static void cmd_message(command_context *ctx, str_view args)
+{
+    engine *chat = ctx->chat;
+
+    // Format the message as "[SERVER]: <message_body>"
+    char formatted_message[ENGINE_NAME_SIZE + 20];
+    snprintf(formatted_message, sizeof(formatted_message), "[SERVER]: %s", args.data);
+    broadcast_message(chat, formatted_message, 0);
+    chat->ops->index_message(chat->io, "SERVER", args.data);
+}
+
+// Runs without the engine lock, so the modules' own locks are never taken inside it
+static void cmd_stats(command_context *ctx, str_view args)
+{
+    engine *chat = ctx->chat;
+    char service_text[ENGINE_REPLY_SIZE / 2];
+    chat->ops->format_stats(chat->io, service_text, sizeof(service_text));
+
+    pthread_mutex_lock(&chat->snapshot_lock);
+    engine_snapshot *snapshot = &chat->snapshot;
+    int conn_count = snapshot->conn_count, client_limit = snapshot->client_limit;
+    unsigned long frames = snapshot->frames, messages = snapshot->messages;
+    pthread_mutex_unlock(&chat->snapshot_lock);
+
+    reply(ctx, "Clients: %d of %d, frames: %lu, messages: %lu\n%s",
+          conn_count, client_limit, frames, messages, service_text);
+}
+
+// "/limit" lists the runtime limits, "/limit <name> <value>" changes one
+static void cmd_limit(command_context *ctx, str_view args)
+{
+    engine *chat = ctx->chat;
+    str_view name = next_token(&args);
+    str_view value = next_token(&args);
+
+    for (int i = 0; i < chat->limit_count; i++)
+    {
+        runtime_limit *limit = &chat->limits[i];
+        if (name.length > 0 && !view_equals(name, limit->name))
+        {
+            continue;
+        }
+        if (value.length == 0)
+        {
+            if (limit->mutex)
+                pthread_mutex_lock(limit->mutex);
+            int current = *limit->value;
+            if (limit->mutex)
+                pthread_mutex_unlock(limit->mutex);
+            reply(ctx, "%s %d", limit->name, current);
+            if (name.length > 0)
+            {
+                return;
+            }
+            continue;
+        }
+
+        // atoi() would wrap long inputs into range, e.g. 4294967301 into 5
+        char *end;
+        errno = 0;
+        long new_value = strtol(value.data, &end, 10);
+        if (end != value.data + value.length || errno == ERANGE ||
+            new_value < limit->min || new_value > limit->max)
+        {
+            reply_error(ctx, "%s must be between %d and %d.", limit->name, limit->min, limit->max);
+            return;
+        }
+        if (limit->mutex)
+            pthread_mutex_lock(limit->mutex);
+        *limit->value = (int)new_value;
+        if (limit->mutex)
+            pthread_mutex_unlock(limit->mutex);
+        reply(ctx, "%s set to %ld", limit->name, new_value);
+        return;
+    }
+    if (name.length > 0)
+    {
+        reply_error(ctx, "Unknown limit '%.*s'.", (int)name.length, name.data);
+    }
+}
+
+// Anything that is not a command is a chat message from the client
+static void send_chat_message(command_context *ctx, const char *text)
+{
+    engine *chat = ctx->chat;
+    engine_conn *conn = ctx->conn;
+    if (!conn->username_set)
+    {
+        reply(ctx, "[SERVER]: You must set a username before sending messages.");
+        return;
+    }
+
+    char formatted_message[ENGINE_NAME_SIZE * 2 + 10];
+    snprintf(formatted_message, sizeof(formatted_message), "[%s]: %s", conn->username, text);
+    broadcast_message(chat, formatted_message, conn->id);
+    chat->ops->index_message(chat->io, conn->username, text);
+    chat->messages++;
+
+    // Log the broadcast message in the server console
+    log_line(chat, "%s", formatted_message);
+}
+
+// Register the commands once; both the client and admin paths dispatch through the same table
+static void register_commands()
+{
+    command_register("username", COMMAND_CLIENT, cmd_username);
+    command_register("help", COMMAND_CLIENT | COMMAND_ADMIN | COMMAND_SNAPSHOT, cmd_help);
+    command_register("list", COMMAND_CLIENT | COMMAND_ADMIN | COMMAND_SNAPSHOT, cmd_list);
+    command_register("private", COMMAND_CLIENT | COMMAND_ADMIN, cmd_private);
+    command_register("search", COMMAND_CLIENT, cmd_search);
+    command_register("quit", COMMAND_CLIENT, cmd_quit);
+    command_register("shutdown", COMMAND_CLIENT | COMMAND_ADMIN, cmd_shutdown);
+    command_register("remove", COMMAND_ADMIN, cmd_remove);
+    command_register("message", COMMAND_ADMIN, cmd_message);
+    command_register("stats", COMMAND_ADMIN | COMMAND_SNAPSHOT, cmd_stats);
+    command_register("limit", COMMAND_ADMIN, cmd_limit);
+}
+
+// Run one frame through the command table
+static void dispatch_command(command_context *ctx, str_view frame)
+{
+    if (frame.length == 0)
+    {
+        return;
+    }
+    if (frame.data[0] != '/')
+    {
+        if (ctx->origin == COMMAND_CLIENT)
+        {
+            send_chat_message(ctx, frame.data);
+        }
+        else
+        {
+            reply_error(ctx, "Unknown command. Type /help for a list of commands.");
+        }
+        return;
+    }
+
+    str_view args = {frame.data + 1, frame.length - 1};
+    const command_entry *command = command_lookup(next_token(&args));
+    if (command == NULL || !(command->flags & ctx->origin))
+    {
+        reply_error(ctx, "%sUnknown command. Type /help for a list of commands.", ctx->conn ? "[SERVER]: " : "");
+        return;
+    }
+    command->handler(ctx, skip_spaces(args));
+}
+
+// Whether an admin frame names a command that only reads the snapshot
+static int reads_snapshot(str_view frame)
+{
+    if (frame.length == 0 || frame.data[0] != '/')
+    {
+        return 0;
+    }
+    str_view args = {frame.data + 1, frame.length - 1};
+    const command_entry *command = command_lookup(next_token(&args));
+    return command != NULL && (command->flags & COMMAND_SNAPSHOT);
+}
+
+// Copy what the admin reads out of the engine; called with the lock held before every
+// entry point that changed something releases it. The roster is only reformatted when it changed.
+static void publish_snapshot(engine *chat)
+{
+    pthread_mutex_lock(&chat->snapshot_lock);
+    engine_snapshot *snapshot = &chat->snapshot;
+    snapshot->conn_count = chat->conn_count;
+    snapshot->client_limit = chat->client_limit;
+    snapshot->frames = chat->frames;
+    snapshot->messages = chat->messages;
+    if (chat->roster_changed)
+    {
+        format_list(chat, snapshot->list, sizeof(snapshot->list));
+        chat->roster_changed = 0;
+    }
+    pthread_mutex_unlock(&chat->snapshot_lock);
+}
+
+static void trace(engine *chat, char event, unsigned long conn_id, str_view data)
+{
+    if (chat->ops->trace != NULL)
+    {
+        chat->ops->trace(chat->io, event, conn_id, data.data, data.length);
+    }
+}
+
+engine *engine_create(const engine_ops *ops, void *io)
+{
+    pthread_once(&commands_once, register_commands);
+
+    engine *chat = calloc(1, sizeof(engine));
+    if (chat == NULL)
+    {
+        return NULL;
+    }
+    chat->ops = ops;
+    chat->io = io;
+    chat->next_id = 1;
+    chat->client_limit = ENGINE_MAX_CLIENTS;
+    pthread_mutex_init(&chat->lock, NULL);
+    pthread_mutex_init(&chat->snapshot_lock, NULL);
+    engine_add_limit(chat, "max_clients", &chat->client_limit, 1, ENGINE_MAX_CLIENTS, NULL);
+    chat->roster_changed = 1;
+    publish_snapshot(chat);
+    return chat;
+}
+
+void engine_destroy(engine *chat)
+{
+    for (int i = 0; i < chat->conn_count; i++)
+    {
+        free(chat->conns[i]);
+    }
+    pthread_mutex_destroy(&chat->lock);
+    pthread_mutex_destroy(&chat->snapshot_lock);
+    free(chat);
+}
+
+// Expose a limit owned by another module to /limit. Returns 0 on success, -1 if the table is full.
+int engine_add_limit(engine *chat, const char *name, int *value, int min, int max, pthread_mutex_t *mutex)
+{
+    if (chat->limit_count == ENGINE_MAX_LIMITS)
+    {
+        return -1;
+    }
+    chat->limits[chat->limit_count++] = (runtime_limit){name, value, min, max, mutex};
+    return 0;
+}
+
+// Number of connections engine_connect() would still accept
+int engine_room(engine *chat)
+{
+    pthread_mutex_lock(&chat->lock);
+    int room = chat->stopped || chat->conn_count >= chat->client_limit ? 0 : chat->client_limit - chat->conn_count;
+    pthread_mutex_unlock(&chat->lock);
+    return room;
+}
+
+// Admit a new connection and prompt it for a username. Returns its id, or 0 if there is no room.
+// A full server is not reported here: the caller may queue the connection and try again, so
+// only the caller knows whether it was really turned away.
+unsigned long engine_connect(engine *chat, int handle)
+{
+    pthread_mutex_lock(&chat->lock);
+    if (chat->stopped || chat->conn_count >= chat->client_limit)
+    {
+        pthread_mutex_unlock(&chat->lock);
+        return 0;
+    }
+    engine_conn *conn = calloc(1, sizeof(engine_conn));
+    if (conn == NULL)
+    {
+        log_line(chat, "Malloc failed");
+        pthread_mutex_unlock(&chat->lock);
+        return 0;
+    }
+
+    conn->id = chat->next_id++;
+    conn->handle = handle;
+    strcpy(conn->username, "Anonymous");
+    chat->conns[chat->conn_count++] = conn;
+    chat->roster_changed = 1;
+    trace(chat, TRACE_CONNECT, conn->id, (str_view){"", 0});
+    log_line(chat, "[%i] Clients connected to the server", chat->conn_count);
+
+    // Prompt the client to set a username
+    send_text(chat, handle, "[SERVER]: Please set your username using /username <name>");
+    unsigned long id = conn->id;
+    publish_snapshot(chat);
+    pthread_mutex_unlock(&chat->lock);
+    return id;
+}
+
+// Process one NUL-terminated frame from a client. Returns 1 when the connection should be closed.
+int engine_client_input(engine *chat, unsigned long conn_id, str_view frame)
+{
+    pthread_mutex_lock(&chat->lock);
+    engine_conn *conn = find_by_id(chat, conn_id);
+    if (conn == NULL || chat->stopped)
+    {
+        // Removed by the admin, or the server is going down
+        pthread_mutex_unlock(&chat->lock);
+        return 1;
+    }
+    trace(chat, TRACE_FRAME, conn_id, frame);
+    chat->frames++;
+
+    command_context ctx = {.chat = chat, .conn = conn, .origin = COMMAND_CLIENT};
+    dispatch_command(&ctx, frame);
+    if (ctx.quit)
+    {
+        // Others were already told this client left
+        remove_conn(chat, conn);
+    }
+    publish_snapshot(chat);
+    pthread_mutex_unlock(&chat->lock);
+    return ctx.quit;
+}
+
+// The I/O layer lost a connection; tell the others unless it already left or was removed
+void engine_disconnect(engine *chat, unsigned long conn_id)
+{
+    pthread_mutex_lock(&chat->lock);
+    trace(chat, TRACE_DISCONNECT, conn_id, (str_view){"", 0});
+    engine_conn *conn = find_by_id(chat, conn_id);
+    if (conn != NULL)
+    {
+        log_line(chat, "Client %s disconnected.", conn->username);
+
+        char quit_message[ENGINE_NAME_SIZE + 50];
+        snprintf(quit_message, sizeof(quit_message), "[SERVER]: %s disconnected.", conn->username);
+        broadcast_message(chat, quit_message, conn_id);
+        remove_conn(chat, conn);
+        publish_snapshot(chat);
+    }
+    pthread_mutex_unlock(&chat->lock);
+}
+
+// Process one NUL-terminated admin command. Returns 1 when the server should shut down.
+// Read-only commands are served from the snapshot, so they never wait behind client traffic.
+int engine_admin_input(engine *chat, str_view frame, const reply_sink *sink)
+{
+    command_context ctx = {.chat = chat, .sink = sink, .origin = COMMAND_ADMIN};
+    if (reads_snapshot(frame))
+    {
+        dispatch_command(&ctx, frame);
+        return 0;
+    }
+
+    pthread_mutex_lock(&chat->lock);
+    trace(chat, TRACE_ADMIN, 0, frame);
+    dispatch_command(&ctx, frame);
+    publish_snapshot(chat);
+    pthread_mutex_unlock(&chat->lock);
+    return ctx.shutdown;
+}
+
+// Deliver an asynchronous result (e.g. a search page) if the connection is still open
+void engine_deliver(engine *chat, unsigned long conn_id, const char *text)
+{
+    pthread_mutex_lock(&chat->lock);
+    engine_conn *conn = find_by_id(chat, conn_id);
+    if (conn != NULL)
+    {
+        send_text(chat, conn->handle, text);
+    }
+    pthread_mutex_unlock(&chat->lock);
+}
@@ -0,0 +1,66 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "protocol.h"
+
+#define ENGINE_MAX_CLIENTS 10
+#define ENGINE_MAX_LIMITS 8
+#define ENGINE_NAME_SIZE FRAME_SIZE
+#define ENGINE_MESSAGE_SIZE (ENGINE_NAME_SIZE * 2 + 50) // Largest private message, as queued for an offline user
+#define ENGINE_REPLY_SIZE (16 * 1024) // Largest single reply, e.g. /list or /help
+
+#define ENGINE_HELP "[SERVER HELP]:\n"                                                  \
+                    "/help - Show this help message\n"                                  \
+                    "/list - List all connected clients\n"                              \
+                    "/message - Send a public message to all clients\n"                 \
+                    "/private <username> <message> - Send a private message to a user\n" \
+                    "/remove <username> - Remove the user with that username\n"         \
+                    "/stats - Show server statistics\n"                                 \
+                    "/limit [name [value]] - Show or change runtime limits\n"          \
+                    "/shutdown - Shut down the server\n"
+
+// Trace events, in the order the engine processed them
+#define TRACE_CONNECT 'C'
+#define TRACE_FRAME 'F'
+#define TRACE_DISCONNECT 'D'
+#define TRACE_ADMIN 'A'
+
+typedef struct engine engine;
+
+// Everything the engine does to the outside world goes through these callbacks.
+// Handles are opaque to the engine; the server uses socket descriptors.
+typedef struct
+{
+    void (*send)(void *io, int handle, const char *data, size_t length);
+    void (*disconnect)(void *io, int handle); // Ask the I/O layer to drop a connection
+    void (*log)(void *io, const char *line);  // Server console output
+    int (*store_offline)(void *io, const char *recipient, const char *message);
+    char *(*take_offline)(void *io, const char *username, unsigned long conn_id, size_t *length); // A malloc'd batch, or NULL if none or delivered later
+    void (*index_message)(void *io, const char *username, const char *text);
+    int (*submit_search)(void *io, unsigned long conn_id, const char *query, int page);
+    void (*format_stats)(void *io, char *out, size_t size);
+    void (*trace)(void *io, char event, unsigned long conn_id, const char *data, size_t length); // Optional
+} engine_ops;
+
+// Where replies to an admin command go
+typedef struct
+{
+    void (*reply)(void *arg, int error, const char *text);
+    void *arg;
+} reply_sink;
+
+engine *engine_create(const engine_ops *ops, void *io);
+void engine_destroy(engine *chat);
+int engine_add_limit(engine *chat, const char *name, int *value, int min, int max, pthread_mutex_t *mutex);
+
+int engine_room(engine *chat);
+unsigned long engine_connect(engine *chat, int handle);
+int engine_client_input(engine *chat, unsigned long conn_id, str_view frame);
+void engine_disconnect(engine *chat, unsigned long conn_id);
+int engine_admin_input(engine *chat, str_view frame, const reply_sink *sink);
+void engine_deliver(engine *chat, unsigned long conn_id, const char *text);
+
+#endif
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "engine.h"
+
+// Fuzz target for the frame reader and the engine behind it.
+//
+// The first input byte picks how many bytes each recv() delivers, so frames get split
+// and batched the way a network would. Frames starting with '!' are sent to the admin
+// path instead, and a frame of just '~' drops the connection and opens a new one.
+//
+// Built with -DFUZZ_LIBFUZZER this is a libFuzzer target; otherwise it has a main()
+// that runs each file argument (or stdin) once, for AFL and for reproducing crashes.
+
+static void null_send(void *io, int handle, const char *data, size_t length)
+{
+}
+
+static void null_disconnect(void *io, int handle)
+{
+}
+
+static void null_log(void *io, const char *line)
+{
+}
+
+static int null_store(void *io, const char *recipient, const char *message)
+{
+    return 0;
+}
+
+static char *null_take(void *io, const char *username, unsigned long conn_id, size_t *length)
+{
+    return NULL;
+}
+
+static void null_index(void *io, const char *username, const char *text)
+{
+}
+
+static int null_search(void *io, unsigned long conn_id, const char *query, int page)
+{
+    return page & 1; // Exercise the busy path too
+}
+
+static void null_stats(void *io, char *out, size_t size)
+{
+    snprintf(out, size, "Fuzz");
+}
+
+static void null_reply(void *arg, int error, const char *text)
+{
+}
+
+static const engine_ops fuzz_ops = {
+    .send = null_send,
+    .disconnect = null_disconnect,
+    .log = null_log,
+    .store_offline = null_store,
+    .take_offline = null_take,
+    .index_message = null_index,
+    .submit_search = null_search,
+    .format_stats = null_stats,
+};
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+    size_t chunk = data[0] ? data[0] : FRAME_SIZE;
+    data++;
+    size--;
+
+    engine *chat = engine_create(&fuzz_ops, NULL);
+    if (chat == NULL)
+    {
+        return 0;
+    }
+    reply_sink sink = {null_reply, NULL};
+    unsigned long conn_id = engine_connect(chat, 1);
+    frame_reader reader = {0};
+
+    while (size > 0 && conn_id != 0)
+    {
+        size_t room;
+        char *space = frame_space(&reader, &room);
+        size_t length = size < chunk ? size : chunk;
+        length = length < room ? length : room;
+        memcpy(space, data, length);
+        reader.length += length;
+        data += length;
+        size -= length;
+
+        str_view frame;
+        while (conn_id != 0 && frame_next(&reader, &frame))
+        {
+            if (frame.length > 0 && frame.data[0] == '!')
+            {
+                str_view command = {frame.data + 1, frame.length - 1};
+                if (engine_admin_input(chat, command, &sink))
+                {
+                    conn_id = 0; // Shut down
+                }
+            }
+            else if (frame.length == 1 && frame.data[0] == '~')
+            {
+                engine_disconnect(chat, conn_id);
+                conn_id = engine_connect(chat, 1);
+            }
+            else if (engine_client_input(chat, conn_id, frame))
+            {
+                engine_disconnect(chat, conn_id);
+                conn_id = engine_connect(chat, 1);
+            }
+        }
+        frame_compact(&reader);
+    }
+
+    engine_destroy(chat);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+// Run one input through the target
+static int run_file(FILE *file)
+{
+    size_t capacity = 4096, size = 0, n;
+    uint8_t *data = malloc(capacity);
+    while (data != NULL && (n = fread(data + size, 1, capacity - size, file)) > 0)
+    {
+        size += n;
+        if (size == capacity)
+        {
+            uint8_t *grown = realloc(data, capacity *= 2);
+            if (grown == NULL)
+            {
+                free(data);
+            }
+            data = grown;
+        }
+    }
+    if (data == NULL)
+    {
+        perror("Malloc failed");
+        return -1;
+    }
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        return run_file(stdin) < 0 ? EXIT_FAILURE : 0;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL)
+        {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        int result = run_file(file);
+        fclose(file);
+        if (result < 0)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
+#endif
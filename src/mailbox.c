@@ -0,0 +1,648 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mailbox.h"
+
+// A private message waiting for an offline user
+typedef struct pending_message
+{
+    struct pending_message *prev, *next;         // Order within the owner's mailbox
+    struct pending_message *lru_prev, *lru_next; // Global order in memory, or in the spill file once spilled
+    struct mailbox *owner;
+    char *data;         // Message text, NULL once spilled to disk
+    off_t spill_offset; // Offset in the spill file when data is NULL
+    int segment;        // Half of the spill file holding it when data is NULL
+    int spill_slot;     // Index in spill_batch while it is being written, -1 otherwise
+    size_t length;
+} pending_message;
+
+// Per-user queue of pending messages, chained in a hash bucket
+typedef struct mailbox
+{
+    struct mailbox *next_in_bucket; // Next delivery job once taken off the table
+    pending_message *head, *tail;
+    int count;
+    int spilled;             // Messages in the spill file
+    unsigned long recipient; // Connection a taken mailbox is delivered to
+    uint32_t hash;
+    char username[]; // Sized to the name, not BUFFER_SIZE
+} mailbox;
+
+typedef struct
+{
+    unsigned long stored;    // Messages queued for offline users
+    unsigned long delivered; // Messages flushed on reconnect
+    unsigned long spilled;   // Messages moved from memory to the spill file
+    unsigned long evicted;   // Messages dropped to stay within the caps
+    unsigned long rejected;  // Messages that could not be queued at all
+} mailbox_stats;
+
+static mailbox *mailboxes[MAILBOX_BUCKETS];                  // Hash table of offline mailboxes
+static pending_message *mailbox_lru_head, *mailbox_lru_tail; // Oldest in-memory message first
+static pending_message *spill_head, *spill_tail;             // Oldest spilled message first
+static size_t mailbox_bytes = 0;                             // Memory charged against mailbox_memory_limit
+static int mailbox_count = 0;
+static mailbox_stats mailbox_counters;
+
+// The spill file is only read and written by the spill thread, never under mailbox_mutex.
+// Its halves are filled in turn, so space is reclaimed without moving records around.
+static int spill_fd = -1;                           // Spill file, -1 when spilling is disabled
+static int active_segment = 0;                      // Half that new spills are appended to
+static off_t segment_end[MAILBOX_SPILL_SEGMENTS];   // Append offset within each half
+static int segment_live[MAILBOX_SPILL_SEGMENTS];    // Records in each half, including those being written
+static int spill_live = 0;                          // Spilled messages not yet delivered or dropped
+static pending_message *spill_batch[MAILBOX_SPILL_BATCH]; // Being written; entries cleared if taken or dropped meanwhile
+static mailbox *delivery_head, *delivery_tail;      // Taken mailboxes with spilled messages, oldest first
+static int delivery_count = 0;
+static pthread_cond_t spill_ready = PTHREAD_COND_INITIALIZER; // Work for the spill thread
+static mailbox_deliver_fn deliver_fn;
+int mailbox_message_limit = MAILBOX_MAX_MESSAGES;
+int mailbox_memory_limit = MAILBOX_MEMORY_LIMIT;
+pthread_mutex_t mailbox_mutex = PTHREAD_MUTEX_INITIALIZER; // Always taken after the engine lock
+
+// FNV-1a hash of a username, used to pick its mailbox bucket
+static uint32_t hash_username(const char *username)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++)
+    {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Find the mailbox for a username, creating it if requested (mailbox_mutex held)
+static mailbox *find_mailbox(const char *username, int create)
+{
+    uint32_t hash = hash_username(username);
+    mailbox **bucket = &mailboxes[hash & (MAILBOX_BUCKETS - 1)];
+    for (mailbox *box = *bucket; box != NULL; box = box->next_in_bucket)
+    {
+        if (box->hash == hash && strcmp(box->username, username) == 0)
+        {
+            return box;
+        }
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+
+    size_t name_length = strlen(username) + 1;
+    mailbox *box = calloc(1, sizeof(mailbox) + name_length);
+    if (box == NULL)
+    {
+        return NULL;
+    }
+    memcpy(box->username, username, name_length);
+    box->hash = hash;
+    box->next_in_bucket = *bucket;
+    *bucket = box;
+    mailbox_bytes += sizeof(mailbox) + name_length;
+    mailbox_count++;
+    return box;
+}
+
+// Unlink an empty mailbox from its bucket and free it (mailbox_mutex held)
+static void release_mailbox(mailbox *box)
+{
+    mailbox **link = &mailboxes[box->hash & (MAILBOX_BUCKETS - 1)];
+    while (*link != box)
+    {
+        link = &(*link)->next_in_bucket;
+    }
+    *link = box->next_in_bucket;
+    mailbox_bytes -= sizeof(mailbox) + strlen(box->username) + 1;
+    mailbox_count--;
+    free(box);
+}
+
+// Remove a message from a global order, in memory or spilled (mailbox_mutex held)
+static void lru_unlink(pending_message *msg, pending_message **head, pending_message **tail)
+{
+    if (msg->lru_prev)
+        msg->lru_prev->lru_next = msg->lru_next;
+    else
+        *head = msg->lru_next;
+    if (msg->lru_next)
+        msg->lru_next->lru_prev = msg->lru_prev;
+    else
+        *tail = msg->lru_prev;
+    msg->lru_prev = msg->lru_next = NULL;
+}
+
+// Append a message to a global order (mailbox_mutex held)
+static void lru_append(pending_message *msg, pending_message **head, pending_message **tail)
+{
+    msg->lru_prev = *tail;
+    if (*tail)
+        (*tail)->lru_next = msg;
+    else
+        *head = msg;
+    *tail = msg;
+}
+
+// Forget a message the spill thread is writing out, so the written copy is discarded (mailbox_mutex held)
+static void cancel_spill(pending_message *msg)
+{
+    if (msg->spill_slot >= 0)
+    {
+        spill_batch[msg->spill_slot] = NULL;
+        msg->spill_slot = -1;
+    }
+}
+
+// Give back a record's space in its half of the spill file (mailbox_mutex held)
+static void release_segment(int segment)
+{
+    if (--segment_live[segment] == 0 && segment == active_segment)
+    {
+        // Nothing live is left in the half being filled, so start it over
+        segment_end[segment] = 0;
+    }
+}
+
+// Account for a spilled message leaving the spill file (mailbox_mutex held)
+static void release_spilled(pending_message *msg)
+{
+    msg->owner->spilled--;
+    spill_live--;
+    release_segment(msg->segment);
+}
+
+// Drop a single message from its mailbox, freeing the mailbox when it empties (mailbox_mutex held)
+static void drop_pending_message(pending_message *msg)
+{
+    mailbox *box = msg->owner;
+    if (msg->prev)
+        msg->prev->next = msg->next;
+    else
+        box->head = msg->next;
+    if (msg->next)
+        msg->next->prev = msg->prev;
+    else
+        box->tail = msg->prev;
+    box->count--;
+
+    if (msg->data)
+    {
+        cancel_spill(msg);
+        lru_unlink(msg, &mailbox_lru_head, &mailbox_lru_tail);
+        mailbox_bytes -= msg->length;
+        free(msg->data);
+    }
+    else
+    {
+        lru_unlink(msg, &spill_head, &spill_tail);
+        release_spilled(msg);
+    }
+    mailbox_bytes -= sizeof(pending_message);
+    free(msg);
+
+    if (box->count == 0)
+    {
+        release_mailbox(box);
+    }
+}
+
+// Find room for a record in the spill file, switching halves when the active one is full.
+// Switching may first evict the messages in the other half, the oldest spilled mail.
+// Returns the offset, or -1 if there is no room (mailbox_mutex held).
+static off_t reserve_spill_space(size_t length)
+{
+    if (segment_end[active_segment] + (off_t)length > MAILBOX_SPILL_SEGMENT_SIZE)
+    {
+        int other = !active_segment;
+        while (spill_head != NULL && spill_head->segment == other && segment_live[other] > 0)
+        {
+            drop_pending_message(spill_head);
+            mailbox_counters.evicted++;
+        }
+        // Records of mailboxes being delivered are still read from the other half
+        if (segment_live[other] > 0)
+        {
+            return -1;
+        }
+        active_segment = other;
+        segment_end[active_segment] = 0;
+        if (segment_end[active_segment] + (off_t)length > MAILBOX_SPILL_SEGMENT_SIZE)
+        {
+            return -1;
+        }
+    }
+    off_t offset = (off_t)active_segment * MAILBOX_SPILL_SEGMENT_SIZE + segment_end[active_segment];
+    segment_end[active_segment] += length;
+    segment_live[active_segment]++;
+    return offset;
+}
+
+// Spilling starts at three quarters of the memory cap (mailbox_mutex held)
+static int should_spill(void)
+{
+    return mailbox_lru_head != NULL && mailbox_bytes > (size_t)mailbox_memory_limit / 4 * 3;
+}
+
+// Write the oldest in-memory messages to the spill file in one go, until memory is down to half
+// the cap. The texts are copied, so the write runs without mailbox_mutex; a message delivered or
+// dropped meanwhile has its record discarded. Returns the number of messages written.
+// Called with mailbox_mutex held, which it releases around the write.
+static int spill_oldest_messages(char **buffer, size_t *buffer_size)
+{
+    static off_t offsets[MAILBOX_SPILL_BATCH]; // Only the spill thread gets here
+    size_t target = (size_t)mailbox_memory_limit / 2;
+    size_t bytes = 0;
+    off_t start = -1;
+    int count = 0;
+    for (pending_message *msg = mailbox_lru_head; msg != NULL && count < MAILBOX_SPILL_BATCH &&
+                                                  bytes < MAILBOX_SPILL_BATCH_BYTES && mailbox_bytes - bytes > target;
+         msg = msg->lru_next)
+    {
+        // One write needs one contiguous run, so a batch never crosses into the other half
+        if (count > 0 && segment_end[active_segment] + (off_t)msg->length > MAILBOX_SPILL_SEGMENT_SIZE)
+        {
+            break;
+        }
+        off_t offset = reserve_spill_space(msg->length);
+        if (offset < 0)
+        {
+            break;
+        }
+        if (bytes + msg->length > *buffer_size)
+        {
+            size_t size = *buffer_size ? *buffer_size : 4096;
+            while (size < bytes + msg->length)
+            {
+                size *= 2;
+            }
+            char *grown = realloc(*buffer, size);
+            if (grown == NULL)
+            {
+                release_segment(offset / MAILBOX_SPILL_SEGMENT_SIZE);
+                break;
+            }
+            *buffer = grown;
+            *buffer_size = size;
+        }
+        if (start < 0)
+        {
+            start = offset;
+        }
+        memcpy(*buffer + bytes, msg->data, msg->length);
+        msg->spill_slot = count;
+        offsets[count] = offset;
+        spill_batch[count++] = msg;
+        bytes += msg->length;
+    }
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    pthread_mutex_unlock(&mailbox_mutex);
+    int written = pwrite(spill_fd, *buffer, bytes, start) == (ssize_t)bytes;
+    if (!written)
+    {
+        perror("Spill write failed");
+    }
+    pthread_mutex_lock(&mailbox_mutex);
+
+    int segment = start / MAILBOX_SPILL_SEGMENT_SIZE;
+    int spilled = 0;
+    for (int i = 0; i < count; i++)
+    {
+        pending_message *msg = spill_batch[i];
+        spill_batch[i] = NULL;
+        if (msg == NULL || !written)
+        {
+            if (msg != NULL)
+            {
+                msg->spill_slot = -1;
+            }
+            release_segment(segment);
+            continue;
+        }
+        msg->spill_slot = -1;
+        lru_unlink(msg, &mailbox_lru_head, &mailbox_lru_tail);
+        lru_append(msg, &spill_head, &spill_tail);
+        free(msg->data);
+        msg->data = NULL;
+        msg->spill_offset = offsets[i];
+        msg->segment = segment;
+        msg->owner->spilled++;
+        spill_live++;
+        mailbox_bytes -= msg->length;
+        mailbox_counters.spilled++;
+        spilled++;
+    }
+    return spilled;
+}
+
+// Read a taken mailbox back into one batch and hand it to the connection that claimed it.
+// Called with mailbox_mutex held, which it releases for the reads and the delivery.
+static void deliver_spilled_mailbox(mailbox *box)
+{
+    // Nothing else can reach the mailbox once it is off the table, so it is read unlocked
+    pthread_mutex_unlock(&mailbox_mutex);
+    char header[100];
+    int header_length = snprintf(header, sizeof(header), "[SERVER]: %d message(s) arrived while you were offline:", box->count);
+    size_t total = header_length + 1;
+    for (pending_message *msg = box->head; msg != NULL; msg = msg->next)
+    {
+        total += msg->length + 1; // Each message is preceded by a newline
+    }
+    char *batch = malloc(total);
+    size_t offset = header_length;
+    int delivered = 0;
+    if (batch != NULL)
+    {
+        memcpy(batch, header, header_length);
+        for (pending_message *msg = box->head; msg != NULL; msg = msg->next)
+        {
+            batch[offset] = '\n';
+            if (msg->data)
+            {
+                memcpy(batch + offset + 1, msg->data, msg->length);
+            }
+            else if (pread(spill_fd, batch + offset + 1, msg->length, msg->spill_offset) != (ssize_t)msg->length)
+            {
+                perror("Spill read failed");
+                continue;
+            }
+            offset += msg->length + 1;
+            delivered++;
+        }
+        batch[offset] = '\0';
+    }
+    else
+    {
+        perror("Malloc failed");
+    }
+    pthread_mutex_lock(&mailbox_mutex);
+
+    for (pending_message *msg = box->head, *next; msg != NULL; msg = next)
+    {
+        next = msg->next;
+        if (msg->data)
+        {
+            mailbox_bytes -= msg->length;
+            free(msg->data);
+        }
+        else
+        {
+            release_spilled(msg);
+        }
+        mailbox_bytes -= sizeof(pending_message);
+        free(msg);
+    }
+    mailbox_bytes -= sizeof(mailbox) + strlen(box->username) + 1;
+    mailbox_counters.delivered += delivered;
+    unsigned long recipient = box->recipient;
+    free(box);
+
+    if (batch != NULL)
+    {
+        // The engine lock is taken before mailbox_mutex, so the delivery runs unlocked
+        pthread_mutex_unlock(&mailbox_mutex);
+        deliver_fn(recipient, batch);
+        free(batch);
+        pthread_mutex_lock(&mailbox_mutex);
+    }
+}
+
+// Moves messages to the spill file as memory fills, and reads them back for delivery
+static void *handle_spill(void *arg)
+{
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    pthread_mutex_lock(&mailbox_mutex);
+    while (1)
+    {
+        if (delivery_head != NULL)
+        {
+            mailbox *box = delivery_head;
+            delivery_head = box->next_in_bucket;
+            if (delivery_head == NULL)
+            {
+                delivery_tail = NULL;
+            }
+            delivery_count--;
+            deliver_spilled_mailbox(box);
+        }
+        else if (should_spill())
+        {
+            if (spill_oldest_messages(&buffer, &buffer_size) == 0)
+            {
+                // No room in the spill file; the caps evict in memory until a delivery frees some
+                pthread_cond_wait(&spill_ready, &mailbox_mutex);
+            }
+        }
+        else
+        {
+            pthread_cond_wait(&spill_ready, &mailbox_mutex);
+        }
+    }
+    return NULL;
+}
+
+// Open the spill file, truncating anything left by an earlier run, and start the thread that
+// uses it. Mailboxes with spilled messages are delivered through deliver. Returns 0 on success.
+int open_spill_file(const char *path, mailbox_deliver_fn deliver)
+{
+    spill_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (spill_fd < 0)
+    {
+        return -1;
+    }
+    deliver_fn = deliver;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handle_spill, NULL) != 0)
+    {
+        close(spill_fd);
+        spill_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Queue a formatted private message for an offline user. Returns 0 on success, -1 if it was rejected.
+int queue_private_message(const char *recipient, const char *message)
+{
+    size_t length = strlen(message);
+    size_t needed = sizeof(pending_message) + length + sizeof(mailbox) + strlen(recipient) + 1;
+
+    pthread_mutex_lock(&mailbox_mutex);
+
+    // Keep each mailbox bounded by dropping its oldest message
+    mailbox *box = find_mailbox(recipient, 0);
+    if (box != NULL && box->count >= mailbox_message_limit)
+    {
+        drop_pending_message(box->head);
+        mailbox_counters.evicted++;
+    }
+
+    // Keep the global footprint bounded, oldest in-memory messages go first. The spill thread
+    // normally keeps memory below the cap, so this only drops messages when it falls behind.
+    // Spilled messages still hold their headers in memory, so once nothing else is left the
+    // oldest of them go.
+    while (mailbox_bytes + needed > (size_t)mailbox_memory_limit && (mailbox_lru_head != NULL || spill_head != NULL))
+    {
+        drop_pending_message(mailbox_lru_head != NULL ? mailbox_lru_head : spill_head);
+        mailbox_counters.evicted++;
+    }
+
+    pending_message *msg = NULL;
+    char *data = NULL;
+    if (mailbox_bytes + needed > (size_t)mailbox_memory_limit ||
+        (msg = calloc(1, sizeof(pending_message))) == NULL ||
+        (data = malloc(length)) == NULL ||
+        (box = find_mailbox(recipient, 1)) == NULL)
+    {
+        free(msg);
+        free(data);
+        mailbox_counters.rejected++;
+        pthread_mutex_unlock(&mailbox_mutex);
+        return -1;
+    }
+
+    memcpy(data, message, length);
+    msg->data = data;
+    msg->length = length;
+    msg->owner = box;
+    msg->spill_slot = -1;
+
+    // Append to the mailbox and to the global in-memory order
+    msg->prev = box->tail;
+    if (box->tail)
+        box->tail->next = msg;
+    else
+        box->head = msg;
+    box->tail = msg;
+    box->count++;
+
+    lru_append(msg, &mailbox_lru_head, &mailbox_lru_tail);
+
+    mailbox_bytes += sizeof(pending_message) + length;
+    mailbox_counters.stored++;
+    if (spill_fd >= 0 && should_spill())
+    {
+        pthread_cond_signal(&spill_ready);
+    }
+    pthread_mutex_unlock(&mailbox_mutex);
+    return 0;
+}
+
+// Empty a user's mailbox into one batch, so it can be sent in a single write.
+// Returns a malloc'd batch of *length bytes, or NULL if nothing was waiting. A mailbox with
+// spilled messages is handed to the spill thread instead, which delivers it to conn_id later,
+// so no disk read happens here.
+char *take_mailbox(const char *username, unsigned long conn_id, size_t *length)
+{
+    pthread_mutex_lock(&mailbox_mutex);
+    mailbox *box = find_mailbox(username, 0);
+    if (box == NULL)
+    {
+        pthread_mutex_unlock(&mailbox_mutex);
+        return NULL;
+    }
+
+    if (box->spilled > 0)
+    {
+        // Take the mailbox off the table and out of the global orders
+        mailbox **link = &mailboxes[box->hash & (MAILBOX_BUCKETS - 1)];
+        while (*link != box)
+        {
+            link = &(*link)->next_in_bucket;
+        }
+        *link = box->next_in_bucket;
+        mailbox_count--;
+        for (pending_message *msg = box->head; msg != NULL; msg = msg->next)
+        {
+            if (msg->data)
+            {
+                cancel_spill(msg);
+                lru_unlink(msg, &mailbox_lru_head, &mailbox_lru_tail);
+            }
+            else
+            {
+                lru_unlink(msg, &spill_head, &spill_tail);
+            }
+        }
+
+        box->recipient = conn_id;
+        box->next_in_bucket = NULL;
+        if (delivery_tail != NULL)
+        {
+            delivery_tail->next_in_bucket = box;
+        }
+        else
+        {
+            delivery_head = box;
+        }
+        delivery_tail = box;
+        delivery_count++;
+        pthread_cond_signal(&spill_ready);
+        pthread_mutex_unlock(&mailbox_mutex);
+        return NULL;
+    }
+
+    char header[100];
+    int header_length = snprintf(header, sizeof(header), "[SERVER]: %d message(s) arrived while you were offline:", box->count);
+    size_t total = header_length;
+    for (pending_message *msg = box->head; msg != NULL; msg = msg->next)
+    {
+        total += msg->length + 1; // Each message is preceded by a newline
+    }
+
+    char *batch = malloc(total);
+    size_t offset = 0;
+    if (batch != NULL)
+    {
+        memcpy(batch, header, header_length);
+        offset = header_length;
+    }
+
+    // The count is copied because dropping the last message frees the mailbox
+    int delivered = 0;
+    for (int remaining = box->count; remaining > 0; remaining--)
+    {
+        pending_message *msg = box->head;
+        if (batch != NULL)
+        {
+            batch[offset] = '\n';
+            memcpy(batch + offset + 1, msg->data, msg->length);
+            offset += msg->length + 1;
+            delivered++;
+        }
+        drop_pending_message(msg); // Frees the mailbox along with the last message
+    }
+    mailbox_counters.delivered += delivered;
+    pthread_mutex_unlock(&mailbox_mutex);
+
+    if (batch == NULL)
+    {
+        perror("Malloc failed");
+        return NULL;
+    }
+    *length = offset;
+    return batch;
+}
+
+// Format offline mailbox statistics into out
+void format_mailbox_stats(char *out, size_t size)
+{
+    pthread_mutex_lock(&mailbox_mutex);
+    snprintf(out, size, "Offline mailboxes: %d (%zu of %d bytes in memory, %d message(s) spilled, %d being read back)\n"
+                        "Stored: %lu, delivered: %lu, spilled: %lu, evicted: %lu, rejected: %lu",
+             mailbox_count, mailbox_bytes, mailbox_memory_limit, spill_live, delivery_count,
+             mailbox_counters.stored, mailbox_counters.delivered, mailbox_counters.spilled,
+             mailbox_counters.evicted, mailbox_counters.rejected);
+    pthread_mutex_unlock(&mailbox_mutex);
+}
@@ -0,0 +1,28 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define MAILBOX_MAX_MESSAGES 32                // Per-user cap on queued private messages
+#define MAILBOX_MEMORY_LIMIT (256 * 1024)      // Global cap on mailbox memory, in bytes
+#define MAILBOX_BUCKETS 256                    // Mailbox hash buckets (must be a power of two)
+#define MAILBOX_SPILL_LIMIT (16 * 1024 * 1024) // Maximum size of the spill file
+#define MAILBOX_SPILL_SEGMENTS 2               // Halves of the spill file, filled in turn
+#define MAILBOX_SPILL_SEGMENT_SIZE (MAILBOX_SPILL_LIMIT / MAILBOX_SPILL_SEGMENTS)
+#define MAILBOX_SPILL_BATCH 256                // Messages written to the spill file at once
+#define MAILBOX_SPILL_BATCH_BYTES (256 * 1024) // Bytes written to the spill file at once
+
+extern int mailbox_message_limit; // Guarded by mailbox_mutex
+extern int mailbox_memory_limit;  // Guarded by mailbox_mutex
+extern pthread_mutex_t mailbox_mutex;
+
+// Called from the spill thread to hand a mailbox read back from disk to its recipient
+typedef void (*mailbox_deliver_fn)(unsigned long conn_id, const char *text);
+
+int open_spill_file(const char *path, mailbox_deliver_fn deliver);
+int queue_private_message(const char *recipient, const char *message);
+char *take_mailbox(const char *username, unsigned long conn_id, size_t *length);
+void format_mailbox_stats(char *out, size_t size);
+
+#endif
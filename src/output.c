@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "output.h"
+
+// Bytes accepted for a client that its socket could not take yet
+typedef struct
+{
+    int socket;
+    char *data;
+    size_t length;
+    size_t capacity;
+    int closed; // Overflowed or failed; further output is dropped
+} output_queue;
+
+int output_queue_limit = OUTPUT_QUEUE_LIMIT;
+pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER; // Never held across a blocking call
+
+static output_queue *queues[OUTPUT_SLOTS];
+static int queue_count = 0;
+static int wake_pipe[2] = {-1, -1}; // Tells the writer thread a queue has filled
+static size_t queued_bytes = 0;
+static unsigned long deferred_sends = 0;   // Sends that had to wait for the writer thread
+static unsigned long slow_disconnects = 0;   // Clients dropped because their queue overflowed
+
+static output_queue *find_queue(int socket)
+{
+    for (int i = 0; i < queue_count; i++)
+    {
+        if (queues[i]->socket == socket)
+        {
+            return queues[i];
+        }
+    }
+    return NULL;
+}
+
+// Send as much of the queue as the socket takes without blocking (output_mutex held)
+static void flush_queue(output_queue *queue)
+{
+    while (queue->length > 0 && !queue->closed)
+    {
+        ssize_t sent = send(queue->socket, queue->data, queue->length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // The client thread sees the failure on its next read and cleans up
+            queue->closed = 1;
+            break;
+        }
+        memmove(queue->data, queue->data + sent, queue->length - sent);
+        queue->length -= sent;
+        queued_bytes -= sent;
+    }
+    if (queue->closed)
+    {
+        queued_bytes -= queue->length;
+        queue->length = 0;
+    }
+}
+
+// Write queued output as sockets become writable
+static void *handle_output(void *arg)
+{
+    struct pollfd fds[OUTPUT_SLOTS + 1];
+    while (1)
+    {
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){.fd = wake_pipe[0], .events = POLLIN};
+        pthread_mutex_lock(&output_mutex);
+        for (int i = 0; i < queue_count; i++)
+        {
+            if (queues[i]->length > 0)
+            {
+                fds[nfds++] = (struct pollfd){.fd = queues[i]->socket, .events = POLLOUT};
+            }
+        }
+        pthread_mutex_unlock(&output_mutex);
+
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("Output poll failed");
+            }
+            continue;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+            {
+            }
+        }
+
+        // A queue may have been closed and its descriptor reused meanwhile; flushing
+        // whatever is queued for that descriptor now is still correct
+        pthread_mutex_lock(&output_mutex);
+        for (int i = 1; i < nfds; i++)
+        {
+            output_queue *queue;
+            if (fds[i].revents && (queue = find_queue(fds[i].fd)) != NULL)
+            {
+                if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+                {
+                    queue->closed = 1;
+                }
+                flush_queue(queue);
+            }
+        }
+        pthread_mutex_unlock(&output_mutex);
+    }
+    return NULL;
+}
+
+// Start the writer thread. Returns 0 on success.
+int output_start()
+{
+    if (pipe(wake_pipe) < 0)
+    {
+        return -1;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handle_output, NULL) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// Give a new client an output queue. Returns -1 if none is available.
+int output_open(int socket)
+{
+    output_queue *queue = calloc(1, sizeof(output_queue));
+    if (queue == NULL)
+    {
+        return -1;
+    }
+    queue->socket = socket;
+
+    pthread_mutex_lock(&output_mutex);
+    if (queue_count == OUTPUT_SLOTS)
+    {
+        pthread_mutex_unlock(&output_mutex);
+        free(queue);
+        return -1;
+    }
+    queues[queue_count++] = queue;
+    pthread_mutex_unlock(&output_mutex);
+    return 0;
+}
+
+// Send to a client without blocking. Whatever the socket cannot take now is queued; a client
+// that lets more than output_queue_limit bytes pile up is disconnected.
+void output_send(int socket, const char *data, size_t length)
+{
+    pthread_mutex_lock(&output_mutex);
+    output_queue *queue = find_queue(socket);
+    if (queue == NULL || queue->closed)
+    {
+        pthread_mutex_unlock(&output_mutex);
+        return;
+    }
+
+    // Send directly while nothing is queued, so output stays in order
+    if (queue->length == 0)
+    {
+        ssize_t sent = send(socket, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            queue->closed = 1;
+            pthread_mutex_unlock(&output_mutex);
+            return;
+        }
+        if (sent > 0)
+        {
+            data += sent;
+            length -= sent;
+        }
+        if (length == 0)
+        {
+            pthread_mutex_unlock(&output_mutex);
+            return;
+        }
+    }
+
+    if (queue->length + length > (size_t)output_queue_limit)
+    {
+        // The client stopped reading; the shutdown wakes its thread, which disconnects it
+        queued_bytes -= queue->length;
+        queue->length = 0;
+        queue->closed = 1;
+        slow_disconnects++;
+        shutdown(socket, SHUT_RDWR);
+        pthread_mutex_unlock(&output_mutex);
+        return;
+    }
+    if (queue->length + length > queue->capacity)
+    {
+        size_t capacity = queue->capacity ? queue->capacity : 4096;
+        while (capacity < queue->length + length)
+        {
+            capacity *= 2;
+        }
+        char *grown = realloc(queue->data, capacity);
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&output_mutex);
+            perror("Output queue allocation failed");
+            return;
+        }
+        queue->data = grown;
+        queue->capacity = capacity;
+    }
+
+    int was_empty = queue->length == 0;
+    memcpy(queue->data + queue->length, data, length);
+    queue->length += length;
+    queued_bytes += length;
+    deferred_sends++;
+    pthread_mutex_unlock(&output_mutex);
+
+    // A full pipe means the writer thread is due to wake anyway
+    if (was_empty)
+    {
+        write(wake_pipe[1], "", 1);
+    }
+}
+
+// Drop a client's queue; called before its socket is closed
+void output_close(int socket)
+{
+    pthread_mutex_lock(&output_mutex);
+    for (int i = 0; i < queue_count; i++)
+    {
+        if (queues[i]->socket == socket)
+        {
+            output_queue *queue = queues[i];
+            queued_bytes -= queue->length;
+            queues[i] = queues[--queue_count];
+            free(queue->data);
+            free(queue);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&output_mutex);
+}
+
+// Format output queue statistics into out
+void format_output_stats(char *out, size_t size)
+{
+    pthread_mutex_lock(&output_mutex);
+    snprintf(out, size, "Output: %d queue(s), %zu byte(s) waiting, %lu deferred send(s), %lu slow client(s) disconnected",
+             queue_count, queued_bytes, deferred_sends, slow_disconnects);
+    pthread_mutex_unlock(&output_mutex);
+}
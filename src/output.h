@@ -0,0 +1,20 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#define OUTPUT_SLOTS 64                    // Connections with an output queue at once
+#define OUTPUT_QUEUE_LIMIT (256 * 1024)    // Default and smallest cap on bytes waiting for one client
+#define OUTPUT_QUEUE_MAX (16 * 1024 * 1024) // Largest cap /limit accepts
+
+extern int output_queue_limit; // Guarded by output_mutex
+extern pthread_mutex_t output_mutex;
+
+int output_start();
+int output_open(int socket);
+void output_send(int socket, const char *data, size_t length);
+void output_close(int socket);
+void format_output_stats(char *out, size_t size);
+
+#endif
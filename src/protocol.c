@@ -0,0 +1,150 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+#define TRIE_NODES (MAX_COMMANDS * COMMAND_NAME_MAX + 1)
+
+// Command names are lower-case letters, so each trie node has 26 children
+typedef struct
+{
+    uint16_t child[26]; // 0 means no child; the root is never a child
+    int8_t entry;       // Index into commands, -1 if no command ends here
+} trie_node;
+
+static command_entry commands[MAX_COMMANDS];
+static int command_count = 0;
+static trie_node trie[TRIE_NODES] = {{.entry = -1}};
+static int trie_size = 1;
+
+// Add a command to the registry. Returns 0 on success, -1 on a bad or duplicate name.
+int command_register(const char *name, int flags, command_handler handler)
+{
+    size_t length = strlen(name);
+    if (command_count == MAX_COMMANDS || length == 0 || length > COMMAND_NAME_MAX)
+    {
+        return -1;
+    }
+
+    int node = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (name[i] < 'a' || name[i] > 'z')
+        {
+            return -1;
+        }
+        int c = name[i] - 'a';
+        if (trie[node].child[c] == 0)
+        {
+            trie[trie_size].entry = -1;
+            trie[node].child[c] = trie_size++;
+        }
+        node = trie[node].child[c];
+    }
+    if (trie[node].entry >= 0)
+    {
+        return -1;
+    }
+
+    command_entry *entry = &commands[command_count];
+    memcpy(entry->name, name, length + 1);
+    entry->flags = flags;
+    entry->handler = handler;
+    trie[node].entry = command_count++;
+    return 0;
+}
+
+// Find a command by name (without the slash). Returns NULL if it is not registered.
+const command_entry *command_lookup(str_view name)
+{
+    if (name.length > COMMAND_NAME_MAX)
+    {
+        return NULL;
+    }
+    int node = 0;
+    for (size_t i = 0; i < name.length; i++)
+    {
+        unsigned c = (unsigned char)name.data[i] - 'a';
+        if (c >= 26 || (node = trie[node].child[c]) == 0)
+        {
+            return NULL;
+        }
+    }
+    return trie[node].entry >= 0 ? &commands[trie[node].entry] : NULL;
+}
+
+// Free space at the end of the reader, for the next recv()
+char *frame_space(frame_reader *reader, size_t *room)
+{
+    *room = FRAME_SIZE - 1 - reader->length;
+    return reader->data + reader->length;
+}
+
+// Return the next complete frame, NUL-terminated in place. Returns 0 when more input is needed.
+int frame_next(frame_reader *reader, str_view *frame)
+{
+    char *begin = reader->data + reader->start;
+    size_t available = reader->length - reader->start;
+    char *end = memchr(begin, '\n', available);
+    if (end != NULL)
+    {
+        reader->start += end - begin + 1;
+    }
+    else if (reader->start == 0 && reader->length == FRAME_SIZE - 1)
+    {
+        // A line that fills the whole buffer is cut into its own frame
+        end = begin + available;
+        reader->start = reader->length;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (end > begin && end[-1] == '\r')
+    {
+        end--;
+    }
+    *end = '\0';
+    frame->data = begin;
+    frame->length = end - begin;
+    return 1;
+}
+
+// Move a trailing partial frame to the front of the buffer
+void frame_compact(frame_reader *reader)
+{
+    memmove(reader->data, reader->data + reader->start, reader->length - reader->start);
+    reader->length -= reader->start;
+    reader->start = 0;
+}
+
+str_view skip_spaces(str_view view)
+{
+    while (view.length > 0 && (*view.data == ' ' || *view.data == '\t'))
+    {
+        view.data++;
+        view.length--;
+    }
+    return view;
+}
+
+// Split off the next space-separated token, advancing cursor past it
+str_view next_token(str_view *cursor)
+{
+    str_view token = skip_spaces(*cursor);
+    size_t length = 0;
+    while (length < token.length && token.data[length] != ' ' && token.data[length] != '\t')
+    {
+        length++;
+    }
+    cursor->data = token.data + length;
+    cursor->length = token.length - length;
+    token.length = length;
+    return token;
+}
+
+int view_equals(str_view view, const char *text)
+{
+    return strlen(text) == view.length && memcmp(view.data, text, view.length) == 0;
+}
@@ -0,0 +1,53 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+
+#define FRAME_SIZE 1024       // Longest command line, including the terminator
+#define MAX_COMMANDS 32       // Registry capacity
+#define COMMAND_NAME_MAX 16   // Longest command name, without the slash
+
+// Where a command may be issued from
+#define COMMAND_CLIENT 1
+#define COMMAND_ADMIN 2
+#define COMMAND_SNAPSHOT 4 // Admin requests only read the published snapshot, so they skip the engine lock
+
+// A non-owning view into a receive buffer
+typedef struct
+{
+    const char *data;
+    size_t length;
+} str_view;
+
+// Caller-defined state handed to every handler
+typedef struct command_context command_context;
+
+typedef void (*command_handler)(command_context *ctx, str_view args);
+
+typedef struct
+{
+    char name[COMMAND_NAME_MAX + 1];
+    int flags; // COMMAND_CLIENT and/or COMMAND_ADMIN, optionally COMMAND_SNAPSHOT
+    command_handler handler;
+} command_entry;
+
+// Splits a byte stream into newline-terminated frames
+typedef struct
+{
+    char data[FRAME_SIZE];
+    size_t length; // Bytes buffered
+    size_t start;  // First byte not yet returned as part of a frame
+} frame_reader;
+
+int command_register(const char *name, int flags, command_handler handler);
+const command_entry *command_lookup(str_view name);
+
+char *frame_space(frame_reader *reader, size_t *room);
+int frame_next(frame_reader *reader, str_view *frame);
+void frame_compact(frame_reader *reader);
+
+str_view next_token(str_view *cursor);
+str_view skip_spaces(str_view view);
+int view_equals(str_view view, const char *text);
+
+#endif
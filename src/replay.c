@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "engine.h"
+
+// One recorded engine call
+typedef struct
+{
+    char event;
+    unsigned long conn_id;
+    char *data; // NUL-terminated, as the engine expects
+    size_t length;
+} trace_event;
+
+// What the engine asked the outside world to do during a replay
+typedef struct
+{
+    unsigned long sends;
+    unsigned long bytes;
+    unsigned long disconnects;
+    unsigned long offline;
+    unsigned long searches;
+    unsigned long replies;
+    unsigned long dropped; // Frames for connections this run does not know
+} replay_counters;
+
+trace_event *events = NULL;
+size_t event_count = 0;
+unsigned long max_conn_id = 0; // Traced ids are sequential, so this sizes the id map
+int verbose = 0;
+
+static void count_send(void *io, int handle, const char *data, size_t length)
+{
+    replay_counters *counters = io;
+    counters->sends++;
+    counters->bytes += length;
+    if (verbose)
+    {
+        printf("-> %d: %.*s\n", handle, (int)length, data);
+    }
+}
+
+static void count_disconnect(void *io, int handle)
+{
+    ((replay_counters *)io)->disconnects++;
+}
+
+static void quiet_log(void *io, const char *line)
+{
+    if (verbose)
+    {
+        printf("%s\n", line);
+    }
+}
+
+// Offline messages are counted but not kept, so every iteration starts from the same state
+static int count_offline(void *io, const char *recipient, const char *message)
+{
+    ((replay_counters *)io)->offline++;
+    return 0;
+}
+
+static char *no_mailbox(void *io, const char *username, unsigned long conn_id, size_t *length)
+{
+    return NULL;
+}
+
+static void skip_index(void *io, const char *username, const char *text)
+{
+}
+
+static int count_search(void *io, unsigned long conn_id, const char *query, int page)
+{
+    ((replay_counters *)io)->searches++;
+    return 0;
+}
+
+static void no_stats(void *io, char *out, size_t size)
+{
+    snprintf(out, size, "Replay: no mailbox or search statistics");
+}
+
+static void count_reply(void *arg, int error, const char *text)
+{
+    ((replay_counters *)arg)->replies++;
+    if (verbose)
+    {
+        printf("%s%s\n", error ? "ERR " : "", text);
+    }
+}
+
+static const engine_ops replay_ops = {
+    .send = count_send,
+    .disconnect = count_disconnect,
+    .log = quiet_log,
+    .store_offline = count_offline,
+    .take_offline = no_mailbox,
+    .index_message = skip_index,
+    .submit_search = count_search,
+    .format_stats = no_stats,
+};
+
+// Read a trace written by "server -r". Returns -1 if the file is malformed.
+int load_trace(FILE *file)
+{
+    size_t capacity = 0;
+    char event;
+    unsigned long conn_id;
+    size_t length;
+    while (fscanf(file, "%c %lu %zu", &event, &conn_id, &length) == 3)
+    {
+        if (fgetc(file) != '\n')
+        {
+            return -1;
+        }
+        if (event_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            trace_event *grown = realloc(events, capacity * sizeof(trace_event));
+            if (grown == NULL)
+            {
+                return -1;
+            }
+            events = grown;
+        }
+        char *data = malloc(length + 1);
+        if (data == NULL || fread(data, 1, length, file) != length || fgetc(file) != '\n')
+        {
+            free(data);
+            return -1;
+        }
+        data[length] = '\0';
+        events[event_count++] = (trace_event){event, conn_id, data, length};
+        if (conn_id > max_conn_id)
+        {
+            max_conn_id = conn_id;
+        }
+    }
+    return feof(file) ? 0 : -1;
+}
+
+// Run the whole trace through a fresh engine. Returns the number of frames processed.
+unsigned long replay_once(replay_counters *counters)
+{
+    // Indexed by the recorded id. Recorded ids and the ids of this run only differ when
+    // connections were turned away; 0 means the connection is not open in this run.
+    unsigned long *replayed_ids = calloc(max_conn_id + 1, sizeof(unsigned long));
+    unsigned long frames = 0;
+
+    engine *chat = engine_create(&replay_ops, counters);
+    if (chat == NULL || replayed_ids == NULL)
+    {
+        perror("Failed to create the chat engine");
+        exit(EXIT_FAILURE);
+    }
+    reply_sink sink = {count_reply, counters};
+
+    for (size_t i = 0; i < event_count; i++)
+    {
+        trace_event *event = &events[i];
+        unsigned long conn_id = replayed_ids[event->conn_id];
+
+        str_view frame = {event->data, event->length};
+        switch (event->event)
+        {
+        case TRACE_CONNECT:
+            // The recorded id doubles as the handle, so verbose output matches the trace
+            replayed_ids[event->conn_id] = engine_connect(chat, (int)event->conn_id);
+            break;
+        case TRACE_FRAME:
+            if (conn_id == 0)
+            {
+                counters->dropped++;
+                break;
+            }
+            engine_client_input(chat, conn_id, frame);
+            frames++;
+            break;
+        case TRACE_DISCONNECT:
+            engine_disconnect(chat, conn_id);
+            replayed_ids[event->conn_id] = 0;
+            break;
+        case TRACE_ADMIN:
+            engine_admin_input(chat, frame, &sink);
+            frames++;
+            break;
+        }
+    }
+
+    engine_destroy(chat);
+    free(replayed_ids);
+    return frames;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 1;
+
+    // Parse command-line options
+    int opt;
+    while ((opt = getopt(argc, argv, "n:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iterations = atoi(optarg); // Replay the trace this many times
+            break;
+        case 'v':
+            verbose = 1; // Print what the engine sends and logs
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-v] trace_file\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 1 || iterations < 1)
+    {
+        fprintf(stderr, "Usage: %s [-n iterations] [-v] trace_file\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *file = fopen(argv[optind], "r");
+    if (file == NULL)
+    {
+        perror("Failed to open trace file");
+        exit(EXIT_FAILURE);
+    }
+    if (load_trace(file) < 0)
+    {
+        fprintf(stderr, "Malformed trace after %zu events.\n", event_count);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    replay_counters counters = {0};
+    unsigned long frames = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++)
+    {
+        frames += replay_once(&counters);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Replayed %zu events %d times: %lu frames in %.3f s\n", event_count, iterations, frames, seconds);
+    if (frames > 0 && seconds > 0)
+    {
+        printf("%.0f frames/s, %.1f ns/frame\n", frames / seconds, seconds * 1e9 / frames);
+    }
+    printf("Sends: %lu (%lu bytes), disconnects: %lu, offline messages: %lu, searches: %lu, admin replies: %lu\n",
+           counters.sends, counters.bytes, counters.disconnects, counters.offline, counters.searches, counters.replies);
+    if (counters.dropped > 0)
+    {
+        fprintf(stderr, "Warning: %lu frame(s) dropped for connections the replay does not know.\n", counters.dropped);
+    }
+    return 0;
+}
@@ -0,0 +1,1015 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "search.h"
+
+#define TERM_MAX 32        // Longest indexed term, including the terminator
+#define QUEUE_LIMIT 64     // Pending queries before new ones are turned away
+#define FROM_PREFIX "from:" // Terms of this form match the message author
+
+// A searchable message; its id is its position in the stream of indexed messages
+typedef struct
+{
+    uint32_t id;
+    time_t time;
+    char *username;
+    char *text;
+    size_t bytes;
+} history_entry;
+
+// Posting list of the segment still being written, kept uncompressed
+typedef struct
+{
+    char *term;
+    uint32_t *ids;
+    int count;
+    int capacity;
+} active_term;
+
+// Dictionary entry of a sealed segment, pointing into its compressed postings
+typedef struct
+{
+    char *term;
+    uint32_t count;
+    uint32_t offset;
+    uint32_t length;
+} segment_term;
+
+// Immutable index over a contiguous range of message ids
+typedef struct
+{
+    uint32_t first_id;
+    uint32_t last_id;
+    int term_count;
+    segment_term *terms; // Sorted by term
+    unsigned char *postings; // Delta-encoded varints
+    size_t bytes;
+} segment;
+
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} byte_buffer;
+
+typedef struct
+{
+    segment_term *terms;
+    int term_count;
+    int term_capacity;
+    byte_buffer postings;
+    size_t term_bytes;
+} segment_builder;
+
+typedef struct pending_doc
+{
+    struct pending_doc *next;
+    time_t time;
+    char *username;
+    char *text;
+} pending_doc;
+
+typedef struct search_job
+{
+    struct search_job *next;
+    unsigned long session_id;
+    int page;
+    char query[];
+} search_job;
+
+// Index state, guarded by index_lock
+static history_entry history[SEARCH_HISTORY_LIMIT];
+static uint32_t oldest_id = 0; // First id still in history
+static uint32_t next_id = 0;   // Id of the next indexed message
+static size_t history_bytes = 0;
+static active_term *active_terms;
+static int active_capacity = 0;
+static int active_term_count = 0;
+static int active_docs = 0;
+static size_t active_bytes = 0;
+static segment *segments[SEARCH_MAX_SEGMENTS + 1]; // Oldest first
+static int segment_count = 0;
+static unsigned long merges = 0;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Work queues, guarded by queue_mutex
+static pending_doc *pending_head, *pending_tail;
+static int pending_count = 0;
+static search_job *job_head, *job_tail;
+static int job_count = 0;
+static unsigned long dropped_docs = 0;
+static unsigned long queries_served = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+
+static search_reply_fn reply_fn;
+
+static int buffer_reserve(byte_buffer *buffer, size_t extra)
+{
+    if (buffer->size + extra <= buffer->capacity)
+    {
+        return 0;
+    }
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+    while (capacity < buffer->size + extra)
+    {
+        capacity *= 2;
+    }
+    unsigned char *data = realloc(buffer->data, capacity);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+static int buffer_append(byte_buffer *buffer, const char *text, size_t length)
+{
+    if (buffer_reserve(buffer, length + 1) < 0)
+    {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->size, text, length);
+    buffer->size += length;
+    buffer->data[buffer->size] = '\0';
+    return 0;
+}
+
+static void put_varint(byte_buffer *buffer, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer->data[buffer->size++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer->data[buffer->size++] = (unsigned char)value;
+}
+
+// Decode a term's posting list into out, which must hold term->count ids
+static int decode_postings(const segment *seg, const segment_term *term, uint32_t *out)
+{
+    const unsigned char *p = seg->postings + term->offset;
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < term->count; i++)
+    {
+        uint32_t delta = 0;
+        int shift = 0;
+        while (*p & 0x80)
+        {
+            delta |= (uint32_t)(*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        delta |= (uint32_t)*p++ << shift;
+        id += delta;
+        out[i] = id;
+    }
+    return term->count;
+}
+
+// Intersect two strictly increasing id lists. out may alias a.
+static int intersect_postings(const uint32_t *a, int na, const uint32_t *b, int nb, uint32_t *out)
+{
+    int i = 0, j = 0, n = 0;
+#ifdef __SSE2__
+    // Compare four ids of a against every rotation of four ids of b at once
+    while (i + 4 <= na && j + 4 <= nb)
+    {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+        __m128i match = _mm_cmpeq_epi32(va, vb);
+        match = _mm_or_si128(match, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1))));
+        match = _mm_or_si128(match, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))));
+        match = _mm_or_si128(match, _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(match));
+
+        uint32_t block[4];
+        _mm_storeu_si128((__m128i *)block, va);
+        uint32_t a_last = block[3];
+        uint32_t b_last = b[j + 3];
+        for (int k = 0; k < 4; k++)
+        {
+            if (mask & (1 << k))
+            {
+                out[n++] = block[k];
+            }
+        }
+        i += (a_last <= b_last) * 4;
+        j += (b_last <= a_last) * 4;
+    }
+#endif
+    while (i < na && j < nb)
+    {
+        uint32_t x = a[i], y = b[j];
+        if (x == y)
+        {
+            out[n++] = x;
+        }
+        i += x <= y;
+        j += y <= x;
+    }
+    return n;
+}
+
+// Copy the next lower-cased word from *cursor into term. Returns its length, 0 at the end.
+static int next_term(const char **cursor, char *term)
+{
+    const unsigned char *p = (const unsigned char *)*cursor;
+    while (*p && !(isalnum(*p) || *p >= 0x80))
+    {
+        p++;
+    }
+    int length = 0;
+    while (*p && (isalnum(*p) || *p >= 0x80))
+    {
+        if (length < TERM_MAX - 1)
+        {
+            term[length++] = (char)tolower(*p);
+        }
+        p++;
+    }
+    term[length] = '\0';
+    *cursor = (const char *)p;
+    return length;
+}
+
+static void author_term(const char *username, char *term)
+{
+    int length = snprintf(term, TERM_MAX, "%s%s", FROM_PREFIX, username);
+    for (int i = 0; i < length && i < TERM_MAX; i++)
+    {
+        term[i] = (char)tolower((unsigned char)term[i]);
+    }
+}
+
+static uint32_t hash_term(const char *term)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)term; *p; p++)
+    {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Find a term in the active segment, or the empty slot where it belongs
+static active_term *active_slot(const char *term)
+{
+    uint32_t mask = active_capacity - 1;
+    for (uint32_t i = hash_term(term) & mask;; i = (i + 1) & mask)
+    {
+        if (active_terms[i].term == NULL || strcmp(active_terms[i].term, term) == 0)
+        {
+            return &active_terms[i];
+        }
+    }
+}
+
+static int active_grow()
+{
+    int old_capacity = active_capacity;
+    active_term *old_terms = active_terms;
+    int capacity = old_capacity ? old_capacity * 2 : 1024;
+    active_term *terms = calloc(capacity, sizeof(active_term));
+    if (terms == NULL)
+    {
+        return -1;
+    }
+    active_terms = terms;
+    active_capacity = capacity;
+    for (int i = 0; i < old_capacity; i++)
+    {
+        if (old_terms[i].term)
+        {
+            *active_slot(old_terms[i].term) = old_terms[i];
+        }
+    }
+    active_bytes += (capacity - old_capacity) * sizeof(active_term);
+    free(old_terms);
+    return 0;
+}
+
+static void active_add(const char *term, uint32_t id)
+{
+    if ((active_term_count + 1) * 2 > active_capacity && active_grow() < 0)
+    {
+        return;
+    }
+    active_term *entry = active_slot(term);
+    if (entry->term == NULL)
+    {
+        if ((entry->term = strdup(term)) == NULL)
+        {
+            return;
+        }
+        active_term_count++;
+        active_bytes += strlen(term) + 1;
+    }
+    if (entry->count > 0 && entry->ids[entry->count - 1] == id)
+    {
+        return; // Term repeated within the same message
+    }
+    if (entry->count == entry->capacity)
+    {
+        int capacity = entry->capacity ? entry->capacity * 2 : 4;
+        uint32_t *ids = realloc(entry->ids, capacity * sizeof(uint32_t));
+        if (ids == NULL)
+        {
+            return;
+        }
+        active_bytes += (capacity - entry->capacity) * sizeof(uint32_t);
+        entry->ids = ids;
+        entry->capacity = capacity;
+    }
+    entry->ids[entry->count++] = id;
+}
+
+static int compare_active_terms(const void *a, const void *b)
+{
+    return strcmp((*(active_term *const *)a)->term, (*(active_term *const *)b)->term);
+}
+
+static int compare_segment_terms(const void *a, const void *b)
+{
+    return strcmp(((const segment_term *)a)->term, ((const segment_term *)b)->term);
+}
+
+static void builder_add(segment_builder *builder, const char *term, const uint32_t *ids, int count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    if (builder->term_count == builder->term_capacity)
+    {
+        int capacity = builder->term_capacity ? builder->term_capacity * 2 : 256;
+        segment_term *terms = realloc(builder->terms, capacity * sizeof(segment_term));
+        if (terms == NULL)
+        {
+            return;
+        }
+        builder->terms = terms;
+        builder->term_capacity = capacity;
+    }
+    // Five bytes is the longest varint for a 32-bit delta
+    if (buffer_reserve(&builder->postings, (size_t)count * 5) < 0)
+    {
+        return;
+    }
+    segment_term *entry = &builder->terms[builder->term_count];
+    if ((entry->term = strdup(term)) == NULL)
+    {
+        return;
+    }
+    entry->count = count;
+    entry->offset = builder->postings.size;
+    uint32_t previous = 0;
+    for (int i = 0; i < count; i++)
+    {
+        put_varint(&builder->postings, ids[i] - previous);
+        previous = ids[i];
+    }
+    entry->length = builder->postings.size - entry->offset;
+    builder->term_bytes += strlen(term) + 1;
+    builder->term_count++;
+}
+
+static segment *builder_finish(segment_builder *builder, uint32_t first_id, uint32_t last_id)
+{
+    segment *seg = calloc(1, sizeof(segment));
+    if (seg == NULL)
+    {
+        for (int i = 0; i < builder->term_count; i++)
+        {
+            free(builder->terms[i].term);
+        }
+        free(builder->terms);
+        free(builder->postings.data);
+        return NULL;
+    }
+    seg->first_id = first_id;
+    seg->last_id = last_id;
+    seg->term_count = builder->term_count;
+    seg->terms = builder->terms;
+    seg->postings = builder->postings.data;
+    seg->bytes = sizeof(segment) + builder->term_count * sizeof(segment_term) + builder->term_bytes +
+                 builder->postings.size;
+    return seg;
+}
+
+static void free_segment(segment *seg)
+{
+    for (int i = 0; i < seg->term_count; i++)
+    {
+        free(seg->terms[i].term);
+    }
+    free(seg->terms);
+    free(seg->postings);
+    free(seg);
+}
+
+static segment *merge_segments(const segment *older, const segment *newer);
+
+// Make room for one more sealed segment. maintain_segments() normally keeps a slot free,
+// but it gives up merging when memory runs out; then the oldest postings are dropped.
+static void reserve_segment_slot()
+{
+    if (segment_count < SEARCH_MAX_SEGMENTS + 1)
+    {
+        return;
+    }
+    segment *merged = merge_segments(segments[0], segments[1]);
+    if (merged != NULL)
+    {
+        free_segment(segments[1]);
+        segments[1] = merged;
+        merges++;
+    }
+    free_segment(segments[0]);
+    memmove(segments, segments + 1, (segment_count - 1) * sizeof(segment *));
+    segment_count--;
+}
+
+// Compress the active segment into a sealed one
+static void seal_active()
+{
+    active_term **sorted = malloc(active_term_count * sizeof(active_term *));
+    if (sorted == NULL)
+    {
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < active_capacity; i++)
+    {
+        if (active_terms[i].term)
+        {
+            sorted[n++] = &active_terms[i];
+        }
+    }
+    qsort(sorted, n, sizeof(active_term *), compare_active_terms);
+
+    segment_builder builder = {0};
+    for (int i = 0; i < n; i++)
+    {
+        builder_add(&builder, sorted[i]->term, sorted[i]->ids, sorted[i]->count);
+    }
+    segment *seg = builder_finish(&builder, next_id - active_docs, next_id - 1);
+    if (seg != NULL)
+    {
+        reserve_segment_slot();
+        segments[segment_count++] = seg;
+    }
+
+    for (int i = 0; i < active_capacity; i++)
+    {
+        free(active_terms[i].term);
+        free(active_terms[i].ids);
+    }
+    free(sorted);
+    free(active_terms);
+    active_terms = NULL;
+    active_capacity = 0;
+    active_term_count = 0;
+    active_docs = 0;
+    active_bytes = 0;
+}
+
+// Decode a term's postings, keeping only ids still in history
+static int live_postings(const segment *seg, const segment_term *term, uint32_t *out)
+{
+    int count = decode_postings(seg, term, out);
+    int skip = 0;
+    while (skip < count && out[skip] < oldest_id)
+    {
+        skip++;
+    }
+    memmove(out, out + skip, (count - skip) * sizeof(uint32_t));
+    return count - skip;
+}
+
+// Merge two adjacent segments (newer may be NULL), dropping postings of expired messages
+static segment *merge_segments(const segment *older, const segment *newer)
+{
+    segment_builder builder = {0};
+    uint32_t *ids = NULL;
+    size_t ids_capacity = 0;
+    int i = 0, j = 0;
+    int older_count = older->term_count;
+    int newer_count = newer ? newer->term_count : 0;
+
+    while (i < older_count || j < newer_count)
+    {
+        int order;
+        if (i == older_count)
+            order = 1;
+        else if (j == newer_count)
+            order = -1;
+        else
+            order = strcmp(older->terms[i].term, newer->terms[j].term);
+
+        size_t needed = (order <= 0 ? older->terms[i].count : 0) + (order >= 0 ? newer->terms[j].count : 0);
+        if (needed > ids_capacity)
+        {
+            uint32_t *grown = realloc(ids, needed * sizeof(uint32_t));
+            if (grown == NULL)
+            {
+                break;
+            }
+            ids = grown;
+            ids_capacity = needed;
+        }
+
+        int count = 0;
+        const char *term = order <= 0 ? older->terms[i].term : newer->terms[j].term;
+        if (order <= 0)
+        {
+            count += live_postings(older, &older->terms[i++], ids);
+        }
+        if (order >= 0)
+        {
+            count += live_postings(newer, &newer->terms[j++], ids + count);
+        }
+        builder_add(&builder, term, ids, count);
+    }
+    free(ids);
+
+    uint32_t first_id = older->first_id > oldest_id ? older->first_id : oldest_id;
+    return builder_finish(&builder, first_id, newer ? newer->last_id : older->last_id);
+}
+
+// Keep the segment list short and free of expired postings
+static void maintain_segments()
+{
+    // Drop segments whose messages have all left history
+    int expired = 0;
+    while (expired < segment_count && segments[expired]->last_id < oldest_id)
+    {
+        free_segment(segments[expired++]);
+    }
+    if (expired > 0)
+    {
+        memmove(segments, segments + expired, (segment_count - expired) * sizeof(segment *));
+        segment_count -= expired;
+    }
+
+    // Compact the oldest segment once most of it has expired
+    if (segment_count > 0)
+    {
+        segment *oldest = segments[0];
+        if (oldest->first_id < oldest_id && (oldest_id - oldest->first_id) * 2 > oldest->last_id - oldest->first_id + 1)
+        {
+            segment *compacted = merge_segments(oldest, NULL);
+            if (compacted != NULL)
+            {
+                free_segment(oldest);
+                segments[0] = compacted;
+                merges++;
+            }
+        }
+    }
+
+    // Merge the adjacent pair covering the fewest messages until under the limit
+    while (segment_count > SEARCH_MAX_SEGMENTS)
+    {
+        int best = 0;
+        uint32_t best_span = UINT32_MAX;
+        for (int i = 0; i + 1 < segment_count; i++)
+        {
+            uint32_t span = segments[i + 1]->last_id - segments[i]->first_id;
+            if (span < best_span)
+            {
+                best_span = span;
+                best = i;
+            }
+        }
+        segment *merged = merge_segments(segments[best], segments[best + 1]);
+        if (merged == NULL)
+        {
+            break;
+        }
+        free_segment(segments[best]);
+        free_segment(segments[best + 1]);
+        segments[best] = merged;
+        memmove(segments + best + 1, segments + best + 2, (segment_count - best - 2) * sizeof(segment *));
+        segment_count--;
+        merges++;
+    }
+}
+
+static void expire_oldest()
+{
+    history_entry *entry = &history[oldest_id % SEARCH_HISTORY_LIMIT];
+    history_bytes -= entry->bytes;
+    free(entry->username);
+    free(entry->text);
+    memset(entry, 0, sizeof(*entry));
+    oldest_id++;
+}
+
+// Add one message to history and the active segment (index_lock held for writing)
+static void index_document(pending_doc *doc)
+{
+    size_t bytes = strlen(doc->username) + strlen(doc->text) + 2;
+    while (next_id - oldest_id >= SEARCH_HISTORY_LIMIT ||
+           (next_id > oldest_id && history_bytes + bytes > SEARCH_HISTORY_BYTES))
+    {
+        expire_oldest();
+    }
+
+    uint32_t id = next_id++;
+    history_entry *entry = &history[id % SEARCH_HISTORY_LIMIT];
+    entry->id = id;
+    entry->time = doc->time;
+    entry->username = doc->username;
+    entry->text = doc->text;
+    entry->bytes = bytes;
+    history_bytes += bytes;
+    doc->username = doc->text = NULL; // Ownership moved to history
+
+    char term[TERM_MAX];
+    author_term(entry->username, term);
+    active_add(term, id);
+    const char *cursor = entry->text;
+    while (next_term(&cursor, term) > 0)
+    {
+        active_add(term, id);
+    }
+
+    if (++active_docs >= SEARCH_SEGMENT_DOCS)
+    {
+        seal_active();
+        maintain_segments();
+    }
+}
+
+static const segment_term *find_segment_term(const segment *seg, const char *term)
+{
+    segment_term key = {.term = (char *)term};
+    return bsearch(&key, seg->terms, seg->term_count, sizeof(segment_term), compare_segment_terms);
+}
+
+// Intersect the terms' postings within a segment (or the active segment when seg is NULL)
+static int match_segment(const segment *seg, char terms[][TERM_MAX], int term_count, uint32_t **result)
+{
+    const segment_term *sealed[SEARCH_MAX_TERMS];
+    const active_term *active[SEARCH_MAX_TERMS];
+    int smallest = 0;
+    uint32_t smallest_count = UINT32_MAX;
+    for (int i = 0; i < term_count; i++)
+    {
+        uint32_t count;
+        if (seg)
+        {
+            if ((sealed[i] = find_segment_term(seg, terms[i])) == NULL)
+                return 0;
+            count = sealed[i]->count;
+        }
+        else
+        {
+            if (active_capacity == 0 || (active[i] = active_slot(terms[i]))->term == NULL)
+                return 0;
+            count = active[i]->count;
+        }
+        if (count < smallest_count)
+        {
+            smallest_count = count;
+            smallest = i;
+        }
+    }
+
+    // Start from the rarest term so the candidate list only shrinks
+    uint32_t *matches = malloc(smallest_count * sizeof(uint32_t));
+    if (matches == NULL)
+    {
+        return 0;
+    }
+    int count;
+    if (seg)
+        count = decode_postings(seg, sealed[smallest], matches);
+    else
+        count = active[smallest]->count, memcpy(matches, active[smallest]->ids, count * sizeof(uint32_t));
+
+    uint32_t *scratch = NULL;
+    for (int i = 0; i < term_count && count > 0; i++)
+    {
+        if (i == smallest)
+        {
+            continue;
+        }
+        const uint32_t *other;
+        int other_count;
+        if (seg)
+        {
+            uint32_t *grown = realloc(scratch, sealed[i]->count * sizeof(uint32_t));
+            if (grown == NULL)
+            {
+                count = 0;
+                break;
+            }
+            scratch = grown;
+            other_count = decode_postings(seg, sealed[i], scratch);
+            other = scratch;
+        }
+        else
+        {
+            other = active[i]->ids;
+            other_count = active[i]->count;
+        }
+        count = intersect_postings(matches, count, other, other_count, matches);
+    }
+    free(scratch);
+    *result = matches;
+    return count;
+}
+
+// Split a query into index terms. Returns the number of terms.
+static int parse_query(const char *query, char terms[][TERM_MAX])
+{
+    int count = 0;
+    char word[BUFSIZ];
+    const char *p = query;
+    while (*p && count < SEARCH_MAX_TERMS)
+    {
+        while (isspace((unsigned char)*p))
+            p++;
+        size_t length = strcspn(p, " \t\r\n");
+        if (length == 0)
+            break;
+        snprintf(word, sizeof(word), "%.*s", (int)length, p);
+        p += length;
+
+        if (strncasecmp(word, FROM_PREFIX, strlen(FROM_PREFIX)) == 0 && word[strlen(FROM_PREFIX)] != '\0')
+        {
+            author_term(word + strlen(FROM_PREFIX), terms[count++]);
+            continue;
+        }
+        const char *cursor = word;
+        while (count < SEARCH_MAX_TERMS && next_term(&cursor, terms[count]) > 0)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+// Run a query and format the requested page of results, newest first
+static char *run_query(const char *query, int page)
+{
+    char terms[SEARCH_MAX_TERMS][TERM_MAX];
+    int term_count = parse_query(query, terms);
+    byte_buffer out = {0};
+    char line[BUFSIZ];
+
+    if (term_count == 0)
+    {
+        snprintf(line, sizeof(line), "[SEARCH]: Usage: /search [-p page] <terms>");
+        buffer_append(&out, line, strlen(line));
+        return (char *)out.data;
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    uint32_t *ids = NULL;
+    int total = 0;
+    for (int s = segment_count; s >= 0; s--)
+    {
+        // The active segment (s == segment_count) holds the newest messages
+        const segment *seg = s == segment_count ? NULL : segments[s];
+        uint32_t *matches = NULL;
+        int count = match_segment(seg, terms, term_count, &matches);
+        if (count > 0)
+        {
+            uint32_t *grown = realloc(ids, (total + count) * sizeof(uint32_t));
+            if (grown != NULL)
+            {
+                ids = grown;
+                for (int i = count - 1; i >= 0; i--)
+                {
+                    if (matches[i] >= oldest_id)
+                    {
+                        ids[total++] = matches[i];
+                    }
+                }
+            }
+        }
+        free(matches);
+    }
+
+    int pages = (total + SEARCH_PAGE_SIZE - 1) / SEARCH_PAGE_SIZE;
+    if (total == 0)
+    {
+        snprintf(line, sizeof(line), "[SEARCH]: No results for '%s'.", query);
+        buffer_append(&out, line, strlen(line));
+    }
+    else if (page > pages)
+    {
+        snprintf(line, sizeof(line), "[SEARCH]: Page %d is out of range (%d result(s), %d page(s)).", page, total, pages);
+        buffer_append(&out, line, strlen(line));
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "[SEARCH]: %d result(s) for '%s' (page %d/%d):", total, query, page, pages);
+        buffer_append(&out, line, strlen(line));
+        int end = page * SEARCH_PAGE_SIZE < total ? page * SEARCH_PAGE_SIZE : total;
+        for (int i = (page - 1) * SEARCH_PAGE_SIZE; i < end; i++)
+        {
+            const history_entry *entry = &history[ids[i] % SEARCH_HISTORY_LIMIT];
+            struct tm local;
+            char stamp[32];
+            localtime_r(&entry->time, &local);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", &local);
+            snprintf(line, sizeof(line), "\n[%s] [%s]: %s", stamp, entry->username, entry->text);
+            buffer_append(&out, line, strlen(line));
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    free(ids);
+    return (char *)out.data;
+}
+
+// Index queued messages in arrival order so posting lists stay sorted
+static void *indexer_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&queue_mutex);
+        while (pending_head == NULL)
+        {
+            pthread_cond_wait(&pending_ready, &queue_mutex);
+        }
+        pending_doc *batch = pending_head;
+        pending_head = pending_tail = NULL;
+        pending_count = 0;
+        pthread_mutex_unlock(&queue_mutex);
+
+        pthread_rwlock_wrlock(&index_lock);
+        for (pending_doc *doc = batch; doc != NULL; doc = doc->next)
+        {
+            index_document(doc);
+        }
+        pthread_rwlock_unlock(&index_lock);
+
+        while (batch != NULL)
+        {
+            pending_doc *next = batch->next;
+            free(batch->username);
+            free(batch->text);
+            free(batch);
+            batch = next;
+        }
+    }
+    return NULL;
+}
+
+static void *query_thread(void *arg)
+{
+    while (1)
+    {
+        pthread_mutex_lock(&queue_mutex);
+        while (job_head == NULL)
+        {
+            pthread_cond_wait(&job_ready, &queue_mutex);
+        }
+        search_job *job = job_head;
+        job_head = job->next;
+        if (job_head == NULL)
+        {
+            job_tail = NULL;
+        }
+        job_count--;
+        pthread_mutex_unlock(&queue_mutex);
+
+        char *result = run_query(job->query, job->page);
+        if (result != NULL)
+        {
+            reply_fn(job->session_id, result);
+        }
+
+        pthread_mutex_lock(&queue_mutex);
+        queries_served++;
+        pthread_mutex_unlock(&queue_mutex);
+        free(result);
+        free(job);
+    }
+    return NULL;
+}
+
+// Start the indexer and query workers. Returns 0 on success, -1 on failure.
+int search_init(search_reply_fn reply)
+{
+    reply_fn = reply;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, indexer_thread, NULL) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(tid);
+    for (int i = 0; i < SEARCH_THREADS; i++)
+    {
+        if (pthread_create(&tid, NULL, query_thread, NULL) != 0)
+        {
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+// Queue a broadcast message for indexing. Never blocks on the index itself.
+void search_index_message(const char *username, const char *text)
+{
+    pending_doc *doc = malloc(sizeof(pending_doc));
+    if (doc == NULL)
+    {
+        return;
+    }
+    doc->next = NULL;
+    doc->time = time(NULL);
+    doc->username = strdup(username);
+    doc->text = strdup(text);
+
+    pthread_mutex_lock(&queue_mutex);
+    if (doc->username == NULL || doc->text == NULL || pending_count >= SEARCH_HISTORY_LIMIT)
+    {
+        dropped_docs++;
+        pthread_mutex_unlock(&queue_mutex);
+        free(doc->username);
+        free(doc->text);
+        free(doc);
+        return;
+    }
+    if (pending_tail)
+        pending_tail->next = doc;
+    else
+        pending_head = doc;
+    pending_tail = doc;
+    pending_count++;
+    pthread_cond_signal(&pending_ready);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+// Queue a query for the search pool. Returns 0 if queued, -1 if the pool is busy.
+int search_submit(unsigned long session_id, const char *query, int page)
+{
+    size_t length = strlen(query) + 1;
+    search_job *job = malloc(sizeof(search_job) + length);
+    if (job == NULL)
+    {
+        return -1;
+    }
+    job->next = NULL;
+    job->session_id = session_id;
+    job->page = page > 0 ? page : 1;
+    memcpy(job->query, query, length);
+
+    pthread_mutex_lock(&queue_mutex);
+    if (job_count >= QUEUE_LIMIT)
+    {
+        pthread_mutex_unlock(&queue_mutex);
+        free(job);
+        return -1;
+    }
+    if (job_tail)
+        job_tail->next = job;
+    else
+        job_head = job;
+    job_tail = job;
+    job_count++;
+    pthread_cond_signal(&job_ready);
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+}
+
+// Format index statistics into out
+void search_format_stats(char *out, size_t size)
+{
+    pthread_rwlock_rdlock(&index_lock);
+    size_t segment_bytes = 0;
+    for (int i = 0; i < segment_count; i++)
+    {
+        segment_bytes += segments[i]->bytes;
+    }
+    int length = snprintf(out, size, "Search index: %u message(s) (%zu bytes), %d segment(s) (%zu bytes), %d active term(s) (%zu bytes), %lu merge(s)\n",
+                          next_id - oldest_id, history_bytes, segment_count, segment_bytes, active_term_count, active_bytes, merges);
+    pthread_rwlock_unlock(&index_lock);
+
+    pthread_mutex_lock(&queue_mutex);
+    if (length >= 0 && (size_t)length < size)
+    {
+        snprintf(out + length, size - length, "Search queue: %d pending message(s), %d pending quer(ies), %lu dropped, %lu served",
+                 pending_count, job_count, dropped_docs, queries_served);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
@@ -0,0 +1,22 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+#define SEARCH_THREADS 2                     // Query workers in the search pool
+#define SEARCH_PAGE_SIZE 10                  // Results returned per page
+#define SEARCH_MAX_TERMS 8                   // Terms considered per query
+#define SEARCH_HISTORY_LIMIT 4096            // Messages kept searchable
+#define SEARCH_HISTORY_BYTES (1024 * 1024)   // Text kept searchable, in bytes
+#define SEARCH_SEGMENT_DOCS 256              // Messages per segment before it is sealed
+#define SEARCH_MAX_SEGMENTS 8                // Sealed segments before two are merged
+
+// Called from a search worker to hand a finished result page back to the server
+typedef void (*search_reply_fn)(unsigned long session_id, const char *text);
+
+int search_init(search_reply_fn reply);
+void search_index_message(const char *username, const char *text);
+int search_submit(unsigned long session_id, const char *query, int page);
+void search_format_stats(char *out, size_t size);
+
+#endif
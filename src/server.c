@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,64 +7,267 @@
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+#include "engine.h"
+#include "mailbox.h"
+#include "search.h"
+#include "worker.h"
+#include "admission.h"
+#include "output.h"
 
 #define DEFAULT_PORT 8080
 #define MIN_PORT 2001 // Minimum allowed port number
-#define MAX_CLIENTS 10
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE FRAME_SIZE
 
+#define ADMIN_MAX_SESSIONS 8            // Concurrent connections to the admin socket
+#define ADMIN_RESPONSE_SIZE (16 * 1024) // Largest response to a single admin request
+
+// A full mailbox is flushed in one send when its owner logs in. /limit keeps that flush, plus one
+// message's worth for the header and the reply before it, within the smallest output queue, so
+// the recipient is never dropped as a slow client with messages already taken from the mailbox.
+#define MAILBOX_FLUSH_MESSAGES (OUTPUT_QUEUE_LIMIT / (ENGINE_MESSAGE_SIZE + 1) - 1)
+
+// What a client thread needs to know about its connection
 typedef struct
 {
     int socket;
-    char username[BUFFER_SIZE];
-    int username_set;     // Flag to check if username is set
-    pthread_t thread_id;  // Thread ID for the client
-    int removed_by_admin; // Flag to track if the client was removed by the admin
-} client_info;
+    unsigned long conn_id; // The engine's id for this connection
+    in_addr_t address;     // Released to admission control when the connection ends
+} client_thread;
+
+// A connection to the admin control socket
+typedef struct
+{
+    int socket;
+    frame_reader reader;
+    char response[ADMIN_RESPONSE_SIZE]; // Body of the response being built
+    size_t response_length;
+    int response_lines;
+    char error[BUFFER_SIZE]; // First error reported by the current request
+    int failed;
+} admin_session;
 
 int server_socket;
-client_info *clients[MAX_CLIENTS]; // Array of pointers to dynamically allocated client_info
-int client_count = 0;
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 int server_running = 1; // Global flag to indicate server status
+engine *chat;           // Client table and command processing
+int spare_fd = -1;      // Given up to turn a connection away when out of descriptors
+
+const char *admin_path = NULL; // Admin control socket path, NULL when disabled
+int admin_socket = -1;
+admin_session *admin_sessions[ADMIN_MAX_SESSIONS]; // Only touched by the main loop
+int admin_session_count = 0;
+
+FILE *trace_file = NULL; // Traffic trace for bin/replay, guarded by trace_mutex
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void *handle_client(void *arg);
 void *handle_input(void *arg);
-void broadcast_message(const char *message, int sender_socket);
-void send_private_message(const char *message, int sender_socket, const char *recipient);
-void send_server_private_message(const char *message, const char *recipient);
-void list_clients(int client_socket);
-void remove_client(int socket);
-void admin_remove_client(const char *username);
-int is_username_unique(const char *username);
-void send_server_help();
+void *handle_handshakes(void *arg);
+void accept_clients();
+int open_admin_socket(const char *path);
+void accept_admin_session();
+int serve_admin_session(admin_session *session);
+int send_admin_response(admin_session *session);
+void deliver_to_client(unsigned long conn_id, const char *text);
 void shutdown_server();
 
+// Engine callbacks: this is where the engine's decisions become socket I/O
+
+// Runs under the engine lock, so it must never block on a client that stops reading
+static void io_send(void *io, int handle, const char *data, size_t length)
+{
+    output_send(handle, data, length);
+}
+
+static void io_disconnect(void *io, int handle)
+{
+    // Wakes the client thread, which closes the socket once the engine has let go of it
+    shutdown(handle, SHUT_RDWR);
+}
+
+static void io_log(void *io, const char *line)
+{
+    printf("%s\n", line);
+}
+
+static int io_store_offline(void *io, const char *recipient, const char *message)
+{
+    return queue_private_message(recipient, message);
+}
+
+static char *io_take_offline(void *io, const char *username, unsigned long conn_id, size_t *length)
+{
+    return take_mailbox(username, conn_id, length);
+}
+
+static void io_index_message(void *io, const char *username, const char *text)
+{
+    search_index_message(username, text);
+}
+
+static int io_submit_search(void *io, unsigned long conn_id, const char *query, int page)
+{
+    return search_submit(conn_id, query, page);
+}
+
+static void io_format_stats(void *io, char *out, size_t size)
+{
+    char mailbox_text[BUFFER_SIZE];
+    char search_text[BUFFER_SIZE];
+    char worker_text[4 * BUFFER_SIZE];
+    char admission_text[BUFFER_SIZE];
+    char output_text[BUFFER_SIZE];
+    format_mailbox_stats(mailbox_text, sizeof(mailbox_text));
+    search_format_stats(search_text, sizeof(search_text));
+    format_worker_stats(worker_text, sizeof(worker_text));
+    format_admission_stats(admission_text, sizeof(admission_text));
+    format_output_stats(output_text, sizeof(output_text));
+    snprintf(out, size, "%s\n%s\n%s\n%s\n%s", mailbox_text, search_text, worker_text, admission_text, output_text);
+}
+
+// Runs under the engine lock; trace_mutex additionally keeps shutdown_server() from closing the file meanwhile
+static void io_trace(void *io, char event, unsigned long conn_id, const char *data, size_t length)
+{
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file != NULL)
+    {
+        fprintf(trace_file, "%c %lu %zu\n", event, conn_id, length);
+        fwrite(data, 1, length, trace_file);
+        fputc('\n', trace_file);
+        fflush(trace_file); // Keep the trace complete up to a crash
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+static const engine_ops server_ops = {
+    .send = io_send,
+    .disconnect = io_disconnect,
+    .log = io_log,
+    .store_offline = io_store_offline,
+    .take_offline = io_take_offline,
+    .index_message = io_index_message,
+    .submit_search = io_submit_search,
+    .format_stats = io_format_stats,
+    .trace = io_trace,
+};
+
 int main(int argc, char *argv[])
 {
     // Ignore SIGPIPE signals
     signal(SIGPIPE, SIG_IGN);
 
     int port = DEFAULT_PORT; // Default port
+    const char *spill_path = NULL;
+    const char *trace_path = NULL;
+    int backlog = ADMISSION_BACKLOG;
+    int handshakes = ADMISSION_HANDSHAKES;
+
+    // Parse command-line options
+    int opt;
+    while ((opt = getopt(argc, argv, "s:a:r:c:b:l:q:p:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            spill_path = optarg; // Spill offline messages to this file
+            break;
+        case 'a':
+            admin_path = optarg; // Serve admin requests on this Unix socket
+            break;
+        case 'r':
+            trace_path = optarg; // Record client and admin traffic for bin/replay
+            break;
+        case 'c':
+            // Pin client threads to these CPUs, round-robin
+            if (parse_cpu_list(optarg) < 0)
+            {
+                fprintf(stderr, "Invalid CPU list '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            worker_busy_poll_us = atoi(optarg); // SO_BUSY_POLL on client sockets
+            break;
+        case 'l':
+            worker_spin_us = atoi(optarg); // Spin on client sockets before sleeping
+            break;
+        case 'q':
+            backlog = atoi(optarg); // Connections the kernel holds until they are accepted
+            break;
+        case 'p':
+            admission_per_ip = atoi(optarg); // Connections allowed from one address
+            break;
+        case 'w':
+            handshakes = atoi(optarg); // Connections handed to the engine at once
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s spill_file] [-a admin_socket] [-r trace_file] [-c cpus] [-b busy_poll_us] [-l spin_us] [-q backlog] [-p per_ip] [-w handshakes] [port]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    // Parse command-line arguments
-    if (argc == 2)
+    // Parse the optional port argument
+    if (argc - optind == 1)
     {
-        port = atoi(argv[1]); // Use the provided port
+        port = atoi(argv[optind]); // Use the provided port
         if (port <= MIN_PORT || port > 65535)
         {
             fprintf(stderr, "Invalid port number. Port must be greater than %d and less than or equal to 65535.\n", MIN_PORT);
             exit(EXIT_FAILURE);
         }
     }
-    else if (argc > 2)
+    else if (argc - optind > 1)
     {
-        fprintf(stderr, "Usage: %s [port]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-s spill_file] [-a admin_socket] [-r trace_file] [-c cpus] [-b busy_poll_us] [-l spin_us] [-q backlog] [-p per_ip] [-w handshakes] [port]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+    if (worker_busy_poll_us < 0 || worker_spin_us < 0)
+    {
+        fprintf(stderr, "Busy poll and spin times cannot be negative.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (backlog < 1 || admission_per_ip < 1 || handshakes < 1)
+    {
+        fprintf(stderr, "The backlog, per-IP cap and handshake count must be positive.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (spill_path != NULL && open_spill_file(spill_path, deliver_to_client) < 0)
+    {
+        perror("Failed to open spill file");
+        exit(EXIT_FAILURE);
+    }
+    if (trace_path != NULL)
+    {
+        // The trace holds private messages, so only the server's user may read it, even when
+        // an older trace with looser permissions is being overwritten
+        int trace_fd = open(trace_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+        if (trace_fd < 0 || fchmod(trace_fd, 0600) < 0 || (trace_file = fdopen(trace_fd, "w")) == NULL)
+        {
+            perror("Failed to open trace file");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    chat = engine_create(&server_ops, NULL);
+    if (chat == NULL)
+    {
+        perror("Failed to create the chat engine");
+        exit(EXIT_FAILURE);
+    }
+    engine_add_limit(chat, "mailbox_messages", &mailbox_message_limit, 1, MAILBOX_FLUSH_MESSAGES, &mailbox_mutex);
+    engine_add_limit(chat, "mailbox_memory", &mailbox_memory_limit, 4096, 64 * 1024 * 1024, &mailbox_mutex);
+    engine_add_limit(chat, "per_ip_connections", &admission_per_ip, 1, 1024, &admission_mutex);
+    engine_add_limit(chat, "admission_queue", &admission_queue_limit, 1, ADMISSION_QUEUE_MAX, &admission_mutex);
+    engine_add_limit(chat, "output_queue", &output_queue_limit, OUTPUT_QUEUE_LIMIT, OUTPUT_QUEUE_MAX, &output_mutex);
+
+    struct sockaddr_in server_addr;
 
     // Create socket
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -73,6 +277,15 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    // Accepted sockets are set up the same way; checking here reports a missing CAP_NET_ADMIN once
+    if (worker_busy_poll_us > 0 &&
+        setsockopt(server_socket, SOL_SOCKET, SO_BUSY_POLL, &worker_busy_poll_us, sizeof(worker_busy_poll_us)) < 0)
+    {
+        perror("SO_BUSY_POLL failed");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
     // Configure server address
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
@@ -94,15 +307,30 @@ int main(int argc, char *argv[])
     }
 
     // Listen for incoming connections
-    if (listen(server_socket, 3) < 0)
+    if (listen(server_socket, backlog) < 0)
     {
         perror("Listen failed");
         close(server_socket);
         exit(EXIT_FAILURE);
     }
+    // The main loop accepts until the queue is drained, so it must not block on an empty one
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
     printf("Server listening on port %d\n", port);
 
+    if (search_init(deliver_to_client) != 0)
+    {
+        perror("Failed to start search workers");
+        exit(EXIT_FAILURE);
+    }
+
+    if (output_start() != 0)
+    {
+        perror("Failed to start the output thread");
+        exit(EXIT_FAILURE);
+    }
+
     pthread_t admin_thread;
     if (pthread_create(&admin_thread, NULL, handle_input, NULL) != 0)
     {
@@ -110,516 +338,453 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    // Accept incoming connections
-    while (server_running)
+    for (int i = 0; i < handshakes; i++)
     {
-        int new_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_len);
-        if (new_socket < 0)
+        pthread_t handshake_thread;
+        if (pthread_create(&handshake_thread, NULL, handle_handshakes, NULL) != 0)
         {
-            perror("Accept failed");
-            continue;
+            perror("Failed to create handshake thread");
+            exit(EXIT_FAILURE);
         }
+        pthread_detach(handshake_thread);
+    }
 
-        printf("New connection accepted. Socket: %d\n", new_socket); // Debug line to track connections
-
-        pthread_mutex_lock(&clients_mutex);
-        if (client_count < MAX_CLIENTS)
+    if (admin_path != NULL)
+    {
+        if ((admin_socket = open_admin_socket(admin_path)) < 0)
         {
-            client_info *new_client = malloc(sizeof(client_info));
-            if (new_client == NULL)
-            {
-                perror("Malloc failed");
-                close(new_socket);
-                pthread_mutex_unlock(&clients_mutex);
-                continue;
-            }
-
-            new_client->socket = new_socket;
-            strncpy(new_client->username, "Anonymous", BUFFER_SIZE - 1);
-            new_client->username_set = 0; // Username not set initially
-            clients[client_count++] = new_client;
-
-            printf("[%i] Clients connected to the server\n", client_count);
+            close(server_socket);
+            exit(EXIT_FAILURE);
+        }
+        printf("Admin socket listening on %s\n", admin_path);
+    }
 
-            // Prompt the client to set a username
-            char prompt_message[BUFFER_SIZE];
-            snprintf(prompt_message, sizeof(prompt_message), "[SERVER]: Please set your username using /username <name>");
-            send(new_socket, prompt_message, strlen(prompt_message), 0);
+    // Serve new connections and admin sessions from one loop
+    while (server_running)
+    {
+        struct pollfd fds[2 + ADMIN_MAX_SESSIONS];
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){.fd = server_socket, .events = POLLIN};
+        if (admin_socket >= 0)
+        {
+            fds[nfds++] = (struct pollfd){.fd = admin_socket, .events = POLLIN};
+        }
+        int first_session = nfds;
+        int session_count = admin_session_count;
+        for (int i = 0; i < session_count; i++)
+        {
+            fds[nfds++] = (struct pollfd){.fd = admin_sessions[i]->socket, .events = POLLIN};
+        }
 
-            // Create a thread to handle the client
-            pthread_t tid;
-            if (pthread_create(&tid, NULL, handle_client, new_client) != 0)
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno != EINTR)
             {
-                perror("Thread creation failed");
-                close(new_socket);
-                free(new_client);
-                client_count--;
+                perror("Poll failed");
             }
-            else
+            continue;
+        }
+
+        // Walk sessions backwards so closing one does not shift those not yet served
+        for (int i = session_count - 1; i >= 0; i--)
+        {
+            if (fds[first_session + i].revents && serve_admin_session(admin_sessions[i]) < 0)
             {
-                new_client->thread_id = tid;                          // Store the thread ID
-                printf("Thread created for client %d\n", new_socket); // Debug line to track thread creation
+                close(admin_sessions[i]->socket);
+                free(admin_sessions[i]);
+                admin_sessions[i] = admin_sessions[--admin_session_count];
             }
         }
-        else
+        if (admin_socket >= 0 && (fds[1].revents & POLLIN))
+        {
+            accept_admin_session();
+        }
+        if (fds[0].revents & POLLIN)
         {
-            printf("Max clients reached. Connection rejected.\n");
-            close(new_socket);
+            accept_clients();
         }
-        pthread_mutex_unlock(&clients_mutex);
     }
 
     close(server_socket);
     return 0;
 }
 
-// Handle client communication
-void *handle_client(void *arg)
+// Accept a batch of pending connections and queue them for admission. Nothing here
+// touches the engine, so a reconnect storm does not hold up message delivery.
+void accept_clients()
 {
-    client_info *client = (client_info *)arg;
-    int socket = client->socket;
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-
-    while (server_running && (bytes_read = recv(socket, buffer, sizeof(buffer) - 1, 0)) > 0)
+    for (int i = 0; i < ADMISSION_ACCEPT_BATCH; i++)
     {
-        buffer[bytes_read] = '\0';
-        if (strncmp(buffer, "/username ", 10) == 0)
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int new_socket = accept4(server_socket, (struct sockaddr *)&client_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_socket >= 0)
         {
-            char *requested_username = buffer + 10;
-            pthread_mutex_lock(&clients_mutex);
-            if (is_username_unique(requested_username))
-            {
-                // Remove leading/trailing spaces from the requested username
-                char cleaned_username[BUFFER_SIZE];
-                snprintf(cleaned_username, sizeof(cleaned_username), "%s", requested_username);
-                // Ensure the username does not exceed the buffer size and is properly null-terminated
-                cleaned_username[BUFFER_SIZE - 1] = '\0';
-
-                // Check if the username is valid (non-empty after trimming)
-                if (strlen(cleaned_username) > 0)
-                {
-                    // Copy the cleaned and validated username into the client structure
-                    strncpy(client->username, cleaned_username, BUFFER_SIZE - 1);
-                    client->username[BUFFER_SIZE - 1] = '\0'; // Ensure null-termination
-                    client->username_set = 1;                 // Username is now set
-
-                    // Construct a success message
-                    char success_message[BUFFER_SIZE + 50]; // Extra space for the prefix
-                    snprintf(success_message, sizeof(success_message), "[SERVER]: Username set to %s", client->username);
-
-                    // Send the success message to the client
-                    if (send(socket, success_message, strlen(success_message), 0) < 0)
-                    {
-                        perror("send failed");
-                        // Handle the error, e.g., close the socket or return
-                    }
-                    else
-                    {
-                        // Construct a notification message for the new user joining
-                        char notification_message[BUFFER_SIZE + 50];
-                        snprintf(notification_message, sizeof(notification_message), "[SERVER]: '%s' has joined the chat room.", client->username);
-
-                        pthread_mutex_unlock(&clients_mutex);
-                        // Broadcast to all clients except the new client
-                        broadcast_message(notification_message, socket);
-                        pthread_mutex_lock(&clients_mutex);
-                    }
-                }
-                else
-                {
-                    char error_message[BUFFER_SIZE];
-                    snprintf(error_message, sizeof(error_message), "[SERVER]: Invalid username. Please provide a non-empty username.");
-                    if (send(socket, error_message, strlen(error_message), 0) < 0)
-                    {
-                        perror("send failed");
-                        // Handle the error, e.g., close the socket or return
-                    }
-                }
-            }
-            else
-            {
-                char error_message[BUFFER_SIZE];
-                snprintf(error_message, sizeof(error_message), "[SERVER]: The username is already taken.");
-                if (send(socket, error_message, strlen(error_message), 0) < 0)
-                {
-                    perror("send failed");
-                    // Handle the error, e.g., close the socket or return
-                }
-            }
-            pthread_mutex_unlock(&clients_mutex);
+            admission_offer(new_socket, client_addr.sin_addr.s_addr);
         }
-        else if (strcmp(buffer, "/help") == 0)
+        else if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0)
         {
-            if (socket == server_socket)
-            {
-                send_server_help();
-            }
-            else
+            // Out of descriptors: free the spare one to accept and close the connection,
+            // rather than leave it in the queue where poll() would report it forever
+            close(spare_fd);
+            int fd = accept(server_socket, NULL, NULL);
+            if (fd >= 0)
             {
-                char error_message[BUFFER_SIZE];
-                snprintf(error_message, sizeof(error_message), "[SERVER]: You do not have permission to see the server help.");
-                send(socket, error_message, strlen(error_message), 0);
+                close(fd);
             }
+            spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            admission_overflow();
         }
-        else if (strncmp(buffer, "/private ", 8) == 0)
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
         {
-            if (client->username_set)
-            {
-                char *recipient = strtok(buffer + 8, " ");
-                char *message = strtok(NULL, "\0");
-                if (recipient && message)
-                {
-                    send_private_message(message, socket, recipient);
-                }
-            }
-            else
-            {
-                char error_message[BUFFER_SIZE];
-                snprintf(error_message, sizeof(error_message), "[SERVER]: You must set a username before sending messages.");
-                send(socket, error_message, strlen(error_message), 0);
-            }
+            return;
+        }
+        else if (errno != ECONNABORTED && errno != EINTR)
+        {
+            perror("Accept failed");
+            return;
         }
-        else if (strcmp(buffer, "/list") == 0)
+    }
+}
+
+// Hand queued connections to the engine, at most one per handshake thread at a time
+void *handle_handshakes(void *arg)
+{
+    while (server_running)
+    {
+        // Wait for a slot before taking a connection, so a full server leaves the queue ordered
+        unsigned long seen = admission_release_count();
+        if (engine_room(chat) == 0)
         {
-            list_clients(socket); // Send the list of usernames to the client
+            admission_wait_release(seen);
+            continue;
         }
-        else if (strcmp(buffer, "/quit") == 0)
+        pending_connection *connection = admission_next();
+        if (connection == NULL)
         {
-            // Send the goodbye message to the client
-            char goodbye_message[BUFFER_SIZE + 50];
-            snprintf(goodbye_message, sizeof(goodbye_message), "[SERVER]: Goodbye, %s!", client->username);
-            if (send(socket, goodbye_message, strlen(goodbye_message), 0) < 0)
-            {
-                perror("Send failed");
-            }
+            continue;
+        }
+
+        // Clients that gave up while queued would only take a slot to find the connection closed
+        int new_socket = connection->socket;
+        char byte;
+        if (recv(new_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+        {
+            admission_abandon(connection);
+            continue;
+        }
 
-            // Notify others about this client quitting
-            char quit_message[BUFFER_SIZE + 50];
-            snprintf(quit_message, sizeof(quit_message), "[SERVER]: %s has left the chat.", client->username);
-            broadcast_message(quit_message, socket); // Broadcast the quit message
+        // Client threads use blocking reads
+        fcntl(new_socket, F_SETFL, fcntl(new_socket, F_GETFL) & ~O_NONBLOCK);
+        worker_prepare_socket(new_socket);
 
-            // Remove the client
-            close(socket);
-            remove_client(socket);
-            pthread_exit(NULL);
+        // The engine greets the client as soon as it connects, so its output queue comes first
+        if (output_open(new_socket) < 0)
+        {
+            admission_retry(connection);
+            continue;
+        }
+        unsigned long conn_id = engine_connect(chat, new_socket);
+        if (conn_id == 0)
+        {
+            // Another thread took the last slot first
+            output_close(new_socket);
+            admission_retry(connection);
+            continue;
         }
-        else if (strcmp(buffer, "/shutdown") == 0)
+        in_addr_t address = connection->address;
+        admission_admitted(connection);
+        printf("New connection accepted. Socket: %d\n", new_socket); // Debug line to track connections
+
+        client_thread *thread = malloc(sizeof(client_thread));
+        pthread_t tid;
+        if (thread == NULL)
         {
-            // Only the server can shut itself down
-            char error_message[BUFFER_SIZE];
-            snprintf(error_message, sizeof(error_message), "[SERVER]: You do not have permission to shut down the server.");
-            send(socket, error_message, strlen(error_message), 0);
+            perror("Malloc failed");
         }
         else
         {
-            if (client->username_set)
-            {
-                // Use a larger buffer for the formatted message
-                char formatted_message[BUFFER_SIZE * 2 + 10]; // Extra space for the prefix
-                snprintf(formatted_message, sizeof(formatted_message), "[%s]: %s", client->username, buffer);
-
-                // Broadcast the message to all clients
-                broadcast_message(formatted_message, socket);
-
-                // Log the broadcast message in the server console
-                printf("%s\n", formatted_message); // Log in [username]: <message> format
-            }
-            else
+            thread->socket = new_socket;
+            thread->conn_id = conn_id;
+            thread->address = address;
+            if (pthread_create(&tid, NULL, handle_client, thread) == 0)
             {
-                char error_message[BUFFER_SIZE];
-                snprintf(error_message, sizeof(error_message), "[SERVER]: You must set a username before sending messages.");
-                send(socket, error_message, strlen(error_message), 0);
+                pthread_detach(tid);
+                printf("Thread created for client %d\n", new_socket); // Debug line to track thread creation
+                continue;
             }
+            perror("Thread creation failed");
+            free(thread);
         }
+        engine_disconnect(chat, conn_id);
+        output_close(new_socket);
+        close(new_socket);
+        admission_release(address);
     }
+    return NULL;
+}
 
-    // Detect client disconnection
-    if (bytes_read == 0)
+// Handle client communication
+void *handle_client(void *arg)
+{
+    client_thread *thread = (client_thread *)arg;
+    int socket = thread->socket;
+    unsigned long conn_id = thread->conn_id;
+    in_addr_t address = thread->address;
+    free(thread);
+
+    // Pins the thread with -c, and holds its input buffer in memory local to that CPU
+    worker *self = worker_start();
+    frame_reader *reader = self ? &self->reader : NULL;
+    int bytes_read = 0;
+    int done = self == NULL;
+
+    // Several commands may arrive in one recv(), and one command may span several
+    while (server_running && !done)
     {
-        printf("Client %s disconnected.\n", client->username);
+        size_t room;
+        struct timespec arrival;
+        char *space = frame_space(reader, &room);
+        if ((bytes_read = worker_recv(self, socket, space, room, &arrival)) <= 0)
+        {
+            break;
+        }
+        reader->length += bytes_read;
+
+        str_view frame;
+        while (!done && frame_next(reader, &frame))
+        {
+            done = engine_client_input(chat, conn_id, frame);
+        }
+        frame_compact(reader);
+        worker_record_latency(self, &arrival);
     }
-    else
+
+    if (bytes_read < 0)
     {
         perror("Receive failed");
     }
-
-    // Check if the client was removed by the admin
-    if (!client->removed_by_admin)
+    if (self != NULL)
     {
-        // Notify others about this client disconnecting
-        char quit_message[BUFFER_SIZE + 50];
-        snprintf(quit_message, sizeof(quit_message), "[SERVER]: %s disconnected.", client->username);
-        broadcast_message(quit_message, socket); // Broadcast the disconnection message
+        worker_stop(self);
     }
 
+    // The engine forgets the connection before the socket is closed, so the descriptor
+    // cannot be reused by a new client while the engine still refers to it
+    engine_disconnect(chat, conn_id);
+    output_close(socket);
     close(socket);
-    remove_client(socket);
-    pthread_exit(NULL);
+    admission_release(address);
+    return NULL;
+}
+
+// Print admin replies on the server console
+static void console_reply(void *arg, int error, const char *text)
+{
+    printf("%s\n", text);
 }
 
 // Handle admin communication
 void *handle_input(void *arg)
 {
     char buffer[BUFFER_SIZE];
+    reply_sink console = {console_reply, NULL};
     while (server_running)
     {                                // Keep running as long as the server is active
-        if (fgets(buffer, BUFFER_SIZE, stdin) != NULL)
+        if (fgets(buffer, BUFFER_SIZE, stdin) == NULL)
         {
-            buffer[strcspn(buffer, "\n")] = '\0'; // Remove newline
-
-            // Process the command
-            if (strcmp(buffer, "/help") == 0)
-            {
-                send_server_help();
-            }
-            else if (strcmp(buffer, "/shutdown") == 0)
-            {
-                shutdown_server();
-            }
-            else if (strcmp(buffer, "/list") == 0)
-            {
-                list_clients(server_socket);
-            }
-            else if (strncmp(buffer, "/remove ", 7) == 0)
-            {
-                char *recipient = strtok(buffer + 8, " ");
-                if (recipient)
-                {
-                    admin_remove_client(recipient);
-                    printf("%s Removed!\n", recipient);
-                }
-            }
-            else if (strncmp(buffer, "/private ", 8) == 0)
-            {
-                char *recipient = strtok(buffer + 8, " ");
-                char *message = strtok(NULL, "\0");
-                if (recipient && message)
-                {
-                    send_server_private_message(message, recipient);
-                }
-            }
-            else if (strncmp(buffer, "/message ", 8) == 0)
-            {
-                // Extract the message body (everything after "/message ")
-                char *message_body = buffer + 8;
-
-                // Format the message as "[SERVER]: <message_body>"
-                char formatted_message[BUFFER_SIZE + 20]; // Extra space for "[SERVER]: "
-                snprintf(formatted_message, sizeof(formatted_message), "[SERVER]: %s", message_body);
-
-                // Broadcast the formatted message to all clients except the server
-                broadcast_message(formatted_message, server_socket);
-            }
-            else
-            {
-                printf("Unknown command. Type /help for a list of commands.\n");
-            }
+            // stdin is closed, e.g. under a supervisor; the admin socket remains
+            printf("Admin console input closed.\n");
+            break;
+        }
+        buffer[strcspn(buffer, "\n")] = '\0'; // Remove newline
+        str_view frame = {buffer, strlen(buffer)};
+        if (engine_admin_input(chat, frame, &console))
+        {
+            shutdown_server();
         }
     }
     return NULL;
 }
 
-// Broadcast a message to all clients except the sender
-void broadcast_message(const char *message, int sender_socket)
+// Collect admin replies into the session's pending response
+static void session_reply(void *arg, int error, const char *text)
 {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++)
+    admin_session *session = arg;
+    if (error)
     {
-        if (clients[i]->socket != sender_socket)
+        // Only the first error is reported, on the status line
+        if (!session->failed)
         {
-            if (send(clients[i]->socket, message, strlen(message), 0) < 0)
-            {
-                perror("Send failed");
-            }
+            snprintf(session->error, sizeof(session->error), "%.*s", (int)sizeof(session->error) - 1, text);
+            session->error[strcspn(session->error, "\n")] = '\0';
+            session->failed = 1;
         }
+        return;
     }
-    pthread_mutex_unlock(&clients_mutex);
-}
 
-// Send a private message to a specific client
-void send_private_message(const char *message, int sender_socket, const char *recipient)
-{
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++)
+    // Append each non-empty line to the response body
+    for (const char *line = text; *line;)
     {
-        if (strcmp(clients[i]->username, recipient) == 0)
+        size_t length = strcspn(line, "\n");
+        if (length > 0)
         {
-            // Find the sender's username
-            char sender_username[BUFFER_SIZE];
-            for (int j = 0; j < client_count; j++)
+            if (session->response_length + length + 1 > sizeof(session->response))
             {
-                if (clients[j]->socket == sender_socket)
-                {
-                    strncpy(sender_username, clients[j]->username, BUFFER_SIZE - 1);
-                    break;
-                }
+                snprintf(session->error, sizeof(session->error), "Response too large");
+                session->failed = 1;
+                return;
             }
-
-            char formatted_message[BUFFER_SIZE * 2];
-            snprintf(formatted_message, sizeof(formatted_message), "[Private from %s]: %s", sender_username, message);
-            if (send(clients[i]->socket, formatted_message, strlen(formatted_message), 0) < 0)
-            {
-                perror("Send failed");
-            }
-            break;
+            memcpy(session->response + session->response_length, line, length);
+            session->response_length += length;
+            session->response[session->response_length++] = '\n';
+            session->response_lines++;
         }
+        line += length + (line[length] == '\n');
     }
-    pthread_mutex_unlock(&clients_mutex);
 }
 
-// Send a private message from the server to a specific client
-void send_server_private_message(const char *message, const char *recipient)
+// Create the admin control socket, replacing a stale one left by an earlier run
+int open_admin_socket(const char *path)
 {
-    pthread_mutex_lock(&clients_mutex);
-    int recipient_found = 0;
-    for (int i = 0; i < client_count; i++)
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
     {
-        if (strcmp(clients[i]->username, recipient) == 0)
-        {
-            char formatted_message[BUFFER_SIZE * 2];
-            snprintf(formatted_message, sizeof(formatted_message), "[Private from SERVER]: %s", message);
-            if (send(clients[i]->socket, formatted_message, strlen(formatted_message), 0) < 0)
-            {
-                perror("Send failed");
-            }
-            recipient_found = 1;
-            break;
-        }
+        fprintf(stderr, "Admin socket path is too long.\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("Admin socket creation failed");
+        return -1;
     }
-    if (!recipient_found)
+    unlink(path);
+    mode_t old_mask = umask(0077); // Only the owner may connect
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(fd, ADMIN_MAX_SESSIONS) < 0)
     {
-        printf("[SERVER]: Recipient '%s' not found.", recipient);
+        perror("Admin socket bind failed");
+        close(fd);
+        return -1;
     }
-    pthread_mutex_unlock(&clients_mutex);
+    return fd;
 }
 
-// Send the list of connected clients to a specific client
-void list_clients(int client_socket)
+// Accept a connection on the admin socket
+void accept_admin_session()
 {
-    if (client_socket == server_socket)
+    int fd = accept(admin_socket, NULL, NULL);
+    if (fd < 0)
     {
-        char list[BUFFER_SIZE * 3] = "Connected clients:\n";
-        for (int i = 0; i < client_count; i++)
-        {
-            strcat(list, clients[i]->username);
-            strcat(list, "\n");
-        }
-        printf("%s", list); // Print the list of connected clients
+        perror("Admin accept failed");
+        return;
     }
-    else
+
+    admin_session *session = NULL;
+    if (admin_session_count == ADMIN_MAX_SESSIONS || (session = calloc(1, sizeof(admin_session))) == NULL)
     {
-        pthread_mutex_lock(&clients_mutex);
-        char list[BUFFER_SIZE * 3] = "Connected clients:\n";
-        for (int i = 0; i < client_count; i++)
-        {
-            strcat(list, clients[i]->username);
-            strcat(list, "\n");
-        }
-        if (send(client_socket, list, strlen(list), 0) < 0)
-        {
-            perror("Send failed");
-        }
-        pthread_mutex_unlock(&clients_mutex);
+        const char *busy = "ERR Too many admin sessions\n";
+        send(fd, busy, strlen(busy), MSG_DONTWAIT);
+        close(fd);
+        return;
     }
+    // The main loop must never block on a slow admin tool
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    session->socket = fd;
+    admin_sessions[admin_session_count++] = session;
 }
 
-// Remove a client from the list
-void remove_client(int socket)
+// Send "OK <lines>" and the body, or "ERR <reason>". Returns -1 if the session should be closed.
+int send_admin_response(admin_session *session)
 {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++)
+    char status[BUFFER_SIZE + 16];
+    struct iovec parts[2] = {{status, 0}, {session->response, session->response_length}};
+    if (session->failed)
     {
-        if (clients[i]->socket == socket)
-        {
-            free(clients[i]);                     // Free the dynamically allocated memory
-            clients[i] = clients[--client_count]; // Replace with the last client
-            clients[client_count] = NULL;         // Clear the last entry
-            break;
-        }
+        parts[0].iov_len = snprintf(status, sizeof(status), "ERR %s\n", session->error);
+        parts[1].iov_len = 0;
     }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-void admin_remove_client(const char *username)
-{
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++)
+    else
     {
-        if (strcmp(clients[i]->username, username) == 0)
-        {
-            // Send the goodbye message to the client
-            char remove_message[BUFFER_SIZE + 50];
-            snprintf(remove_message, sizeof(remove_message), "[SERVER]: You are kicked out by the admin!");
-            if (send(clients[i]->socket, remove_message, strlen(remove_message), 0) < 0)
-            {
-                perror("Send failed");
-            }
+        parts[0].iov_len = snprintf(status, sizeof(status), "OK %d\n", session->response_lines);
+    }
+    size_t total = parts[0].iov_len + parts[1].iov_len;
 
-            // Mark the client as removed by the admin
-            clients[i]->removed_by_admin = 1;
+    session->response_length = 0;
+    session->response_lines = 0;
+    session->failed = 0;
 
-            free(clients[i]);                     // Free the dynamically allocated memory
-            clients[i] = clients[--client_count]; // Replace with the last client
-            clients[client_count] = NULL;         // Clear the last entry
-            break;
-        }
-    }
-    pthread_mutex_unlock(&clients_mutex);
+    // A response that does not fit in the socket buffer means the tool is not reading
+    return writev(session->socket, parts, 2) == (ssize_t)total ? 0 : -1;
 }
 
-// Check if a username is unique
-int is_username_unique(const char *username)
+// Answer the requests waiting on an admin session. Returns -1 when the session should be closed.
+int serve_admin_session(admin_session *session)
 {
-    for (int i = 0; i < client_count; i++)
+    size_t room;
+    char *space = frame_space(&session->reader, &room);
+    ssize_t bytes_read = recv(session->socket, space, room, 0);
+    if (bytes_read <= 0)
+    {
+        return bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    session->reader.length += bytes_read;
+
+    reply_sink sink = {session_reply, session};
+    str_view frame;
+    while (frame_next(&session->reader, &frame))
     {
-        if (strcmp(clients[i]->username, username) == 0)
+        if (frame.length == 0)
+        {
+            continue;
+        }
+        int shutdown_requested = engine_admin_input(chat, frame, &sink);
+        if (send_admin_response(session) < 0)
         {
-            return 0; // Username is not unique
+            return -1;
+        }
+        if (shutdown_requested)
+        {
+            shutdown_server();
         }
     }
-    return 1; // Username is unique
+    frame_compact(&session->reader);
+    return 0;
 }
 
-// Send server help instructions
-void send_server_help()
+// Deliver a search result page or a mailbox read back from disk, if the connection is still open
+void deliver_to_client(unsigned long conn_id, const char *text)
 {
-    printf("\a"); // This will produce a beep sound in the terminal
-    printf("\n[SERVER HELP]:\n"
-           "/help - Show this help message\n"
-           "/list - List all connected clients\n"
-           "/message - Send a public message to all clients\n"
-           "/private <username> <message> - Send a private message to a user\n"
-           "/remove <username> - Remove the user with that username\n"
-           "/shutdown - Shut down the server\n\n");
+    engine_deliver(chat, conn_id, text);
 }
 
-// Shut down the server gracefully
+// Shut down the server; the engine has already notified the clients
 void shutdown_server()
 {
     printf("Server is shutting down...\n");
 
-    // Notify all clients that the server is shutting down
-    char shutdown_message[BUFFER_SIZE];
-    snprintf(shutdown_message, sizeof(shutdown_message), "[SERVER]: The server is shutting down. You will be disconnected.");
-    broadcast_message(shutdown_message, -1); // Send to all clients
-
-    // Close all client sockets
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++)
-    {
-        close(clients[i]->socket); // Close the socket
-        free(clients[i]);          // Free the dynamically allocated memory
-    }
-    client_count = 0; // Reset the client count
-    pthread_mutex_unlock(&clients_mutex);
-
     // Set the server_running flag to 0
     server_running = 0;
 
     // Close the server socket
     close(server_socket);
+    if (admin_path != NULL)
+    {
+        unlink(admin_path);
+    }
+    // Client threads still trace their disconnects while the process exits
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file != NULL)
+    {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_mutex);
 
     printf("Server has been shut down.\n");
     exit(0); // Exit the server process
-}
\ No newline at end of file
+}
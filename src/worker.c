@@ -0,0 +1,431 @@
+#define _GNU_SOURCE // pthread_setaffinity_np, CPU_SET
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "worker.h"
+
+int worker_busy_poll_us = 0;
+int worker_spin_us = 0;
+
+static int worker_cpus[WORKER_MAX_CPUS]; // Set once by parse_cpu_list() before any worker starts
+static int worker_cpu_count = 0;
+
+static worker *workers[WORKER_SLOTS]; // Kept after their thread exits, so histograms cover the whole run
+static int claimed[WORKER_SLOTS];
+static pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Only the owning thread writes its counters; the relaxed store keeps /stats readers well-defined
+static void bump(unsigned long *counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static unsigned long load(const unsigned long *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static long elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Parse a CPU list such as "0-3,6" for -c. Returns -1 if it is malformed or names an unusable CPU.
+int parse_cpu_list(const char *list)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        perror("sched_getaffinity failed");
+        return -1;
+    }
+
+    const char *cursor = list;
+    worker_cpu_count = 0;
+    while (*cursor)
+    {
+        char *end;
+        long first = strtol(cursor, &end, 10);
+        long last = first;
+        if (end == cursor)
+        {
+            return -1;
+        }
+        if (*end == '-')
+        {
+            cursor = end + 1;
+            last = strtol(cursor, &end, 10);
+            if (end == cursor)
+            {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed))
+            {
+                fprintf(stderr, "CPU %ld is not available to the server.\n", cpu);
+                return -1;
+            }
+            if (worker_cpu_count == WORKER_MAX_CPUS)
+            {
+                fprintf(stderr, "At most %d CPUs can be given.\n", WORKER_MAX_CPUS);
+                return -1;
+            }
+            worker_cpus[worker_cpu_count++] = (int)cpu;
+        }
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end != '\0')
+        {
+            return -1;
+        }
+        cursor = end;
+    }
+    return worker_cpu_count > 0 ? 0 : -1;
+}
+
+// Memory for a worker comes straight from mmap, so no other thread shares its pages
+// and the first touch below decides which NUMA node they live on
+static worker *allocate_worker()
+{
+    worker *self = mmap(NULL, sizeof(worker), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (self == MAP_FAILED)
+    {
+        return NULL;
+    }
+    memset(self, 0, sizeof(worker));
+    return self;
+}
+
+// Set up the calling client thread: claim a slot, pin it to that slot's CPU and find its state
+worker *worker_start()
+{
+    int slot = -1;
+    worker *self = NULL;
+    pthread_mutex_lock(&workers_mutex);
+    for (int i = 0; i < WORKER_SLOTS; i++)
+    {
+        if (!claimed[i])
+        {
+            claimed[i] = 1;
+            slot = i;
+            self = workers[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&workers_mutex);
+
+    // Slot i always runs on the same CPU, so a reused worker's memory is still local
+    int cpu = -1;
+    if (slot >= 0 && worker_cpu_count > 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker_cpus[slot % worker_cpu_count], &set);
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (error != 0)
+        {
+            fprintf(stderr, "Failed to pin worker %d: %s\n", slot, strerror(error));
+        }
+        else
+        {
+            cpu = worker_cpus[slot % worker_cpu_count];
+        }
+    }
+
+    if (self == NULL)
+    {
+        if ((self = allocate_worker()) == NULL)
+        {
+            perror("Worker allocation failed");
+            if (slot >= 0)
+            {
+                pthread_mutex_lock(&workers_mutex);
+                claimed[slot] = 0;
+                pthread_mutex_unlock(&workers_mutex);
+            }
+            return NULL;
+        }
+        self->slot = slot;
+        if (slot >= 0)
+        {
+            pthread_mutex_lock(&workers_mutex);
+            workers[slot] = self;
+            pthread_mutex_unlock(&workers_mutex);
+        }
+    }
+    __atomic_store_n(&self->cpu, cpu, __ATOMIC_RELAXED);
+    self->spin_us = worker_spin_us;
+    self->reader.length = 0;
+    self->reader.start = 0;
+    return self;
+}
+
+// Release the worker when its client thread exits; its statistics are kept
+void worker_stop(worker *self)
+{
+    if (self->slot < 0)
+    {
+        munmap(self, sizeof(worker));
+        return;
+    }
+    pthread_mutex_lock(&workers_mutex);
+    claimed[self->slot] = 0;
+    pthread_mutex_unlock(&workers_mutex);
+}
+
+// Apply the latency options to a new client socket
+void worker_prepare_socket(int socket)
+{
+    int on = 1;
+    // Kernel receive timestamps give the latency histograms their starting point
+    setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    if (worker_busy_poll_us > 0)
+    {
+        // Checked against the listening socket at startup, so failures are not reported here
+        setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &worker_busy_poll_us, sizeof(worker_busy_poll_us));
+    }
+    if (worker_busy_poll_us > 0 || worker_spin_us > 0)
+    {
+        // Low-latency mode: replies should not wait for the previous one to be acknowledged
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+}
+
+// recv() that also reports when the data reached the socket
+static ssize_t receive(int socket, char *buffer, size_t size, int flags, struct timespec *arrival)
+{
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = {buffer, size};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t bytes_read = recvmsg(socket, &message, flags);
+    if (bytes_read <= 0)
+    {
+        return bytes_read;
+    }
+
+    clock_gettime(CLOCK_REALTIME, arrival); // Used if the kernel did not timestamp the data
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            memcpy(arrival, CMSG_DATA(header), sizeof(struct timespec));
+        }
+    }
+    return bytes_read;
+}
+
+// Read from a client socket. With -l the thread spins for up to its budget before sleeping in poll();
+// the budget doubles when spinning pays off and halves when the thread had to sleep anyway.
+ssize_t worker_recv(worker *self, int socket, char *buffer, size_t size, struct timespec *arrival)
+{
+    if (worker_spin_us == 0)
+    {
+        // One blocking read; telling a sleep from a ready socket would cost another syscall
+        ssize_t bytes_read = receive(socket, buffer, size, 0, arrival);
+        if (bytes_read > 0)
+        {
+            bump(&self->reads);
+        }
+        return bytes_read;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int slept = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = receive(socket, buffer, size, MSG_DONTWAIT, arrival)) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        if (slept || elapsed_us(&start) >= self->spin_us)
+        {
+            if (!slept)
+            {
+                slept = 1;
+                self->spin_us = self->spin_us / 2 > WORKER_MIN_SPIN_US ? self->spin_us / 2 : WORKER_MIN_SPIN_US;
+            }
+            struct pollfd fd = {.fd = socket, .events = POLLIN};
+            if (poll(&fd, 1, -1) < 0 && errno != EINTR)
+            {
+                return -1;
+            }
+            continue;
+        }
+        cpu_relax();
+    }
+
+    if (bytes_read > 0)
+    {
+        bump(&self->reads);
+        if (slept)
+        {
+            bump(&self->sleeps);
+        }
+        else
+        {
+            bump(&self->spin_hits);
+            self->spin_us = self->spin_us * 2 < worker_spin_us ? self->spin_us * 2 : worker_spin_us;
+        }
+    }
+    return bytes_read;
+}
+
+// Record how long a read waited between reaching the socket and being fully processed
+void worker_record_latency(worker *self, const struct timespec *arrival)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long nanoseconds = (now.tv_sec - arrival->tv_sec) * 1000000000L + (now.tv_nsec - arrival->tv_nsec);
+    int bucket = nanoseconds > 1 ? 63 - __builtin_clzl(nanoseconds) : 0;
+    if (bucket >= LATENCY_BUCKETS)
+    {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+    bump(&self->latency[bucket]);
+}
+
+// Format the upper bound of a latency bucket
+static void format_bound(char *out, size_t size, int bucket)
+{
+    double nanoseconds = (double)(1UL << (bucket + 1));
+    if (bucket == LATENCY_BUCKETS - 1)
+    {
+        snprintf(out, size, "inf");
+    }
+    else if (nanoseconds < 1000)
+    {
+        snprintf(out, size, "%.0fns", nanoseconds);
+    }
+    else if (nanoseconds < 1000000)
+    {
+        snprintf(out, size, "%.1fus", nanoseconds / 1000);
+    }
+    else
+    {
+        snprintf(out, size, "%.1fms", nanoseconds / 1000000);
+    }
+}
+
+// Format "p50 <x p99 <y p99.9 <z" for a histogram
+static void format_percentiles(char *out, size_t size, const unsigned long *histogram)
+{
+    static const double points[] = {0.5, 0.99, 0.999};
+    static const char *names[] = {"p50", "p99", "p99.9"};
+    unsigned long total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        total += histogram[i];
+    }
+    if (total == 0)
+    {
+        snprintf(out, size, "no samples");
+        return;
+    }
+
+    size_t length = 0;
+    for (int p = 0; p < 3; p++)
+    {
+        unsigned long rank = (unsigned long)(points[p] * total);
+        unsigned long seen = 0;
+        int bucket = 0;
+        while (bucket < LATENCY_BUCKETS - 1 && (seen += histogram[bucket]) <= rank)
+        {
+            bucket++;
+        }
+        char bound[16];
+        format_bound(bound, sizeof(bound), bucket);
+        int written = snprintf(out + length, size - length, "%s%s <%s", p ? " " : "", names[p], bound);
+        if (written < 0 || (size_t)written >= size - length)
+        {
+            return;
+        }
+        length += written;
+    }
+}
+
+// Format per-worker latency and polling statistics into out
+void format_worker_stats(char *out, size_t size)
+{
+    unsigned long total[LATENCY_BUCKETS] = {0};
+    char text[128];
+    size_t length = 0;
+    int written;
+
+    if (worker_spin_us > 0)
+    {
+        written = snprintf(out, size, "Workers: spin up to %d us then sleep, busy poll %d us\n", worker_spin_us, worker_busy_poll_us);
+    }
+    else
+    {
+        written = snprintf(out, size, "Workers: blocking reads, busy poll %d us\n", worker_busy_poll_us);
+    }
+    if (written < 0 || (size_t)written >= size)
+    {
+        return;
+    }
+    length = written;
+
+    pthread_mutex_lock(&workers_mutex);
+    for (int i = 0; i < WORKER_SLOTS; i++)
+    {
+        worker *self = workers[i];
+        if (self == NULL)
+        {
+            continue;
+        }
+        unsigned long histogram[LATENCY_BUCKETS];
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            histogram[b] = load(&self->latency[b]);
+            total[b] += histogram[b];
+        }
+        format_percentiles(text, sizeof(text), histogram);
+        char cpu[16] = "-";
+        int pinned = __atomic_load_n(&self->cpu, __ATOMIC_RELAXED);
+        if (pinned >= 0)
+        {
+            snprintf(cpu, sizeof(cpu), "%d", pinned);
+        }
+        if (worker_spin_us > 0)
+        {
+            written = snprintf(out + length, size - length, "Worker %d (cpu %s): %lu read(s), %s, %lu spin hit(s), %lu sleep(s)\n",
+                               i, cpu, load(&self->reads), text, load(&self->spin_hits), load(&self->sleeps));
+        }
+        else
+        {
+            written = snprintf(out + length, size - length, "Worker %d (cpu %s): %lu read(s), %s, sleeps n/a\n",
+                               i, cpu, load(&self->reads), text);
+        }
+        if (written < 0 || (size_t)written >= size - length)
+        {
+            pthread_mutex_unlock(&workers_mutex);
+            return;
+        }
+        length += written;
+    }
+    pthread_mutex_unlock(&workers_mutex);
+
+    format_percentiles(text, sizeof(text), total);
+    snprintf(out + length, size - length, "Read latency (arrival to processed): %s", text);
+}
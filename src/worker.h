@@ -0,0 +1,40 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "protocol.h"
+
+#define WORKER_SLOTS 16          // Client threads with their own placement and histogram
+#define WORKER_MAX_CPUS 64       // CPUs accepted by -c
+#define WORKER_MIN_SPIN_US 2     // The adaptive spin budget never drops below this
+#define LATENCY_BUCKETS 32       // Power-of-two nanosecond buckets, the last one open-ended
+
+// State owned by one client thread. It is allocated by the thread after it has been pinned,
+// so on a NUMA machine the pages land on the node of the CPU that uses them.
+typedef struct
+{
+    int slot;                                // Index in the stats table, -1 when every slot was taken
+    int cpu;                                 // CPU the thread is pinned to, -1 when unpinned
+    int spin_us;                             // Current spin budget, adapted between WORKER_MIN_SPIN_US and worker_spin_us
+    frame_reader reader;                     // Input buffer of the current connection
+    unsigned long latency[LATENCY_BUCKETS];  // Arrival to processed, per read; updated with relaxed atomics
+    unsigned long reads;
+    unsigned long spin_hits;  // Reads that data arrived for while spinning (-l only)
+    unsigned long sleeps;     // Reads that had to block in poll() (-l only)
+} worker;
+
+extern int worker_busy_poll_us; // SO_BUSY_POLL for client sockets, 0 to leave it off
+extern int worker_spin_us;      // Spin this long before sleeping on a socket, 0 to always block
+
+int parse_cpu_list(const char *list);
+worker *worker_start();
+void worker_stop(worker *self);
+void worker_prepare_socket(int socket);
+ssize_t worker_recv(worker *self, int socket, char *buffer, size_t size, struct timespec *arrival);
+void worker_record_latency(worker *self, const struct timespec *arrival);
+void format_worker_stats(char *out, size_t size);
+
+#endif